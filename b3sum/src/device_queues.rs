@@ -0,0 +1,181 @@
+//! Reading many files from many disks at once, for `--device-queues`.
+//!
+//! Hashing a list of files one after another leaves every disk but one idle,
+//! and hashing them all in parallel makes spinning disks seek between files.
+//! Instead we group the inputs by the device they live on (`st_dev`), and give
+//! each device its own reader threads. A spinning disk gets one queue, which
+//! reads its files one at a time, front to back, with up to `depth` windows in
+//! flight. A solid-state device gets `depth` queues, each reading a different
+//! file. The reader threads only do I/O; each window they read is hashed on the
+//! shared rayon pool, so the hashing threads don't depend on the number of
+//! disks. Results come back to the calling thread, which hands them out in
+//! command line order.
+
+use anyhow::Result;
+use std::collections::{BTreeMap, HashMap};
+use std::fs;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
+use std::sync::Arc;
+use std::thread;
+
+use crate::direct_io::DirectFile;
+use crate::Args;
+
+// Each window in flight is a 2 MiB buffer, and a host with many disks has many
+// queues, so this is lower than the single-file default.
+pub const DEFAULT_DEPTH: usize = 4;
+
+// Split a Linux dev_t into its major and minor numbers, the same way glibc's
+// major() and minor() do.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub fn major_minor(dev: u64) -> (u64, u64) {
+    let major = ((dev >> 8) & 0xfff) | ((dev >> 32) & 0xffff_f000);
+    let minor = (dev & 0xff) | ((dev >> 12) & 0xffff_ff00);
+    (major, minor)
+}
+
+// Ask sysfs whether a block device spins. For a partition, the queue
+// attributes live on the parent disk. Anything we can't identify (tmpfs,
+// network filesystems, other platforms) is treated as solid-state, since
+// parallel reads don't hurt there.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn is_rotational(dev: u64) -> bool {
+    let (major, minor) = major_minor(dev);
+    let base = format!("/sys/dev/block/{}:{}", major, minor);
+    ["queue/rotational", "../queue/rotational"]
+        .iter()
+        .filter_map(|attr| fs::read_to_string(Path::new(&base).join(attr)).ok())
+        .next()
+        .map_or(false, |value| value.trim() == "1")
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+fn is_rotational(_dev: u64) -> bool {
+    false
+}
+
+struct Group {
+    // Indexes into the caller's list of paths, in command line order.
+    indexes: Vec<usize>,
+    next: AtomicUsize,
+    // The number of reader threads, and the reads each one keeps in flight.
+    queues: usize,
+    file_depth: usize,
+}
+
+// Put each path in a group with the others on the same device. Stdin, paths we
+// can't stat, and things that aren't regular files share one sequential group
+// of their own, which keeps their errors in order.
+fn group_by_device(paths: &[PathBuf], depth: usize) -> Vec<Group> {
+    let mut devices: HashMap<u64, Vec<usize>> = HashMap::new();
+    let mut others = Vec::new();
+    for (index, path) in paths.iter().enumerate() {
+        match fs::metadata(path) {
+            Ok(metadata) if metadata.is_file() && path != Path::new("-") => {
+                devices.entry(metadata.dev()).or_default().push(index)
+            }
+            _ => others.push(index),
+        }
+    }
+    let new_group = |indexes, queues, file_depth| Group {
+        indexes,
+        next: AtomicUsize::new(0),
+        queues,
+        file_depth,
+    };
+    let mut groups: Vec<Group> = devices
+        .into_iter()
+        .map(|(dev, indexes)| {
+            if is_rotational(dev) {
+                new_group(indexes, 1, depth)
+            } else {
+                new_group(indexes, depth, 1)
+            }
+        })
+        .collect();
+    if !others.is_empty() {
+        groups.push(new_group(others, 1, 1));
+    }
+    groups
+}
+
+fn hash_file(
+    path: &Path,
+    args: &Args,
+    pool: &rayon::ThreadPool,
+    depth: usize,
+) -> Result<blake3::OutputReader> {
+    if path == Path::new("-") {
+        return crate::hash_path(path, args);
+    }
+    // Without --direct-io these are ordinary buffered reads, which can come
+    // back short anywhere in the file. read_window only treats a short read as
+    // EOF in Direct mode, so Cached reads keep going until they get zero.
+    let file = if args.direct_io() {
+        DirectFile::open(path)?
+    } else {
+        DirectFile::open_cached(path)?
+    };
+    match file {
+        Some(file) => {
+            let mut hasher = args.base_hasher.clone();
+            file.hash(&mut hasher, depth, args.throttle.as_ref(), Some(pool))?;
+            Ok(hasher.finalize_xof())
+        }
+        // Not a regular file, so hash_path won't mmap it. It reads it
+        // single-threaded, without the pool.
+        None => crate::hash_path(path, args),
+    }
+}
+
+/// Hash every one of `args.file_args` using per-device queues, and call
+/// `finish` with each result in command line order. This blocks the calling
+/// thread, which therefore must not be one of the pool's own threads.
+pub fn hash_all(
+    args: &Arc<Args>,
+    pool: &Arc<rayon::ThreadPool>,
+    depth: usize,
+    mut finish: impl FnMut(&Path, Result<blake3::OutputReader>),
+) {
+    let depth = std::cmp::max(depth, 1);
+    let (sender, receiver) = mpsc::channel();
+    let mut readers = Vec::new();
+    for group in group_by_device(&args.file_args, depth) {
+        let group = Arc::new(group);
+        for _ in 0..group.queues {
+            let group = group.clone();
+            let args = args.clone();
+            let pool = pool.clone();
+            let sender = sender.clone();
+            readers.push(thread::spawn(move || loop {
+                let next = group.next.fetch_add(1, Ordering::Relaxed);
+                let index = match group.indexes.get(next) {
+                    Some(&index) => index,
+                    None => return,
+                };
+                let path = &args.file_args[index];
+                let result = hash_file(path, &args, &pool, group.file_depth);
+                if sender.send((index, result)).is_err() {
+                    return;
+                }
+            }));
+        }
+    }
+    drop(sender);
+
+    let mut pending = BTreeMap::new();
+    let mut next_index = 0;
+    for (index, result) in receiver {
+        pending.insert(index, result);
+        while let Some(result) = pending.remove(&next_index) {
+            finish(&args.file_args[next_index], result);
+            next_index += 1;
+        }
+    }
+    for reader in readers {
+        reader.join().expect("reader thread panicked");
+    }
+}
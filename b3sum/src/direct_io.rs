@@ -0,0 +1,361 @@
+//! Hashing files without filling the page cache, for `--direct-io`.
+//!
+//! Both mmap and buffered reads leave every page of the input in the page
+//! cache, which evicts whatever else was there. When verifying large amounts
+//! of cold data on a shared machine, that's the wrong tradeoff. Here we open
+//! files with `O_DIRECT` where we can (`F_NOCACHE` on macOS), and read them in
+//! large aligned windows, with several reads in flight at once to keep the
+//! device queue full. Each window is hashed with `update_rayon`, so the hashing
+//! of one window is spread across the thread pool while the following windows
+//! are being read. Where direct I/O isn't supported (for example on tmpfs, or
+//! on some network filesystems), we fall back to regular reads and tell the
+//! kernel to drop each window from the cache with `POSIX_FADV_DONTNEED` once
+//! it's been hashed. The same windowed reader, with the page cache left alone,
+//! also serves the per-device queues in `device_queues`.
+
+use anyhow::{bail, Result};
+use std::collections::BTreeMap;
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc;
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+use crate::throttle::Throttle;
+
+// O_DIRECT requires the buffer address, the file offset, and the read length
+// to be multiples of the logical block size of the device. 4096 covers every
+// common device. Windows must also be a multiple of ALIGNMENT.
+const ALIGNMENT: usize = 4096;
+pub const WINDOW_LEN: usize = 2 * 1024 * 1024;
+pub const DEFAULT_QUEUE_DEPTH: usize = 8;
+
+// A heap buffer with the alignment that O_DIRECT needs. Vec<u8> only
+// guarantees byte alignment.
+struct AlignedBuffer {
+    ptr: *mut u8,
+    len: usize,
+}
+
+// The buffer is uniquely owned, and it's passed between threads by value.
+unsafe impl Send for AlignedBuffer {}
+
+impl AlignedBuffer {
+    fn layout(len: usize) -> std::alloc::Layout {
+        std::alloc::Layout::from_size_align(len, ALIGNMENT).unwrap()
+    }
+
+    fn new(len: usize) -> Self {
+        let ptr = unsafe { std::alloc::alloc(Self::layout(len)) };
+        if ptr.is_null() {
+            std::alloc::handle_alloc_error(Self::layout(len));
+        }
+        Self { ptr, len }
+    }
+
+    fn as_slice(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+
+    fn as_mut_slice(&mut self) -> &mut [u8] {
+        unsafe { std::slice::from_raw_parts_mut(self.ptr, self.len) }
+    }
+}
+
+impl Drop for AlignedBuffer {
+    fn drop(&mut self) {
+        unsafe { std::alloc::dealloc(self.ptr, Self::layout(self.len)) }
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum CacheMode {
+    // Reads bypass the page cache entirely.
+    Direct,
+    // Regular reads, with each window dropped from the cache after hashing.
+    DropBehind,
+    // Regular reads, cached as usual.
+    Cached,
+}
+
+pub struct DirectFile {
+    file: Arc<File>,
+    len: u64,
+    mode: CacheMode,
+}
+
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn open_direct(path: &Path) -> io::Result<File> {
+    use std::os::unix::fs::OpenOptionsExt;
+    OpenOptions::new()
+        .read(true)
+        .custom_flags(libc::O_DIRECT)
+        .open(path)
+}
+
+#[cfg(any(target_os = "macos", target_os = "ios"))]
+fn open_direct(path: &Path) -> io::Result<File> {
+    use std::os::unix::io::AsRawFd;
+    let file = File::open(path)?;
+    if unsafe { libc::fcntl(file.as_raw_fd(), libc::F_NOCACHE, 1) } == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(file)
+}
+
+#[cfg(not(any(
+    target_os = "linux",
+    target_os = "android",
+    target_os = "macos",
+    target_os = "ios"
+)))]
+fn open_direct(_path: &Path) -> io::Result<File> {
+    Err(io::Error::from_raw_os_error(libc::EINVAL))
+}
+
+#[cfg(any(target_os = "linux", target_os = "android", target_os = "freebsd"))]
+pub fn fadvise(file: &File, offset: u64, len: u64, advice: libc::c_int) {
+    use std::os::unix::io::AsRawFd;
+    // This is only advice, and there's nothing useful to do if it fails.
+    unsafe {
+        libc::posix_fadvise(
+            file.as_raw_fd(),
+            offset as libc::off_t,
+            len as libc::off_t,
+            advice,
+        );
+    }
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android", target_os = "freebsd")))]
+pub fn fadvise(_file: &File, _offset: u64, _len: u64, _advice: i32) {}
+
+#[cfg(any(target_os = "linux", target_os = "android", target_os = "freebsd"))]
+pub use libc::{POSIX_FADV_DONTNEED, POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED};
+#[cfg(not(any(target_os = "linux", target_os = "android", target_os = "freebsd")))]
+pub const POSIX_FADV_DONTNEED: i32 = 0;
+#[cfg(not(any(target_os = "linux", target_os = "android", target_os = "freebsd")))]
+pub const POSIX_FADV_SEQUENTIAL: i32 = 0;
+#[cfg(not(any(target_os = "linux", target_os = "android", target_os = "freebsd")))]
+pub const POSIX_FADV_WILLNEED: i32 = 0;
+
+// Fill as much of `buf` as we can from `offset`. With O_DIRECT, a read that
+// stops short of a block boundary can only mean EOF, and continuing from an
+// unaligned offset would fail with EINVAL anyway, so we stop there. Regular
+// reads can come back short in the middle of a file (on FUSE or network
+// filesystems, for example), so without O_DIRECT we keep going until EOF.
+pub fn read_window(
+    file: &impl FileExt,
+    buf: &mut [u8],
+    offset: u64,
+    mode: CacheMode,
+) -> io::Result<usize> {
+    let mut filled = 0;
+    while filled < buf.len() {
+        match file.read_at(&mut buf[filled..], offset + filled as u64) {
+            Ok(0) => break,
+            Ok(n) => {
+                filled += n;
+                if mode == CacheMode::Direct && filled % ALIGNMENT != 0 {
+                    break;
+                }
+            }
+            Err(ref e) if e.kind() == io::ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e),
+        }
+    }
+    Ok(filled)
+}
+
+fn round_up_to_alignment(n: usize) -> usize {
+    (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT
+}
+
+impl DirectFile {
+    /// Open a file for uncached reading. Returns None for things that aren't
+    /// regular files, which the caller should read the usual way.
+    pub fn open(path: &Path) -> Result<Option<Self>> {
+        match open_direct(path) {
+            Ok(file) => Self::from_file(file, CacheMode::Direct),
+            // EINVAL means that this filesystem doesn't support direct I/O.
+            Err(ref e) if e.raw_os_error() == Some(libc::EINVAL) => Self::open_drop_behind(path),
+            Err(e) => Err(e.into()),
+        }
+    }
+
+    pub fn open_drop_behind(path: &Path) -> Result<Option<Self>> {
+        let file = File::open(path)?;
+        fadvise(&file, 0, 0, POSIX_FADV_SEQUENTIAL);
+        Self::from_file(file, CacheMode::DropBehind)
+    }
+
+    pub fn open_cached(path: &Path) -> Result<Option<Self>> {
+        let file = File::open(path)?;
+        fadvise(&file, 0, 0, POSIX_FADV_SEQUENTIAL);
+        Self::from_file(file, CacheMode::Cached)
+    }
+
+    fn from_file(file: File, mode: CacheMode) -> Result<Option<Self>> {
+        let metadata = file.metadata()?;
+        if !metadata.is_file() {
+            return Ok(None);
+        }
+        Ok(Some(Self {
+            file: Arc::new(file),
+            // Like the mmap path, we hash exactly the length that the file had
+            // when we opened it.
+            len: metadata.len(),
+            mode,
+        }))
+    }
+
+    fn num_windows(&self) -> u64 {
+        (self.len + WINDOW_LEN as u64 - 1) / WINDOW_LEN as u64
+    }
+
+    fn window_len(&self, index: u64) -> usize {
+        let offset = index * WINDOW_LEN as u64;
+        std::cmp::min(WINDOW_LEN as u64, self.len - offset) as usize
+    }
+
+    // Hash one window that has been read into `buf`, and then drop it from
+    // the page cache if it went through there. When the calling thread isn't
+    // part of the hashing pool, `pool` says where the hashing should run.
+    fn finish_window(
+        &self,
+        index: u64,
+        buf: &AlignedBuffer,
+        n: usize,
+        hasher: &mut blake3::Hasher,
+        pool: Option<&rayon::ThreadPool>,
+    ) -> Result<()> {
+        let expected_len = self.window_len(index);
+        if n < expected_len {
+            bail!("File shrank while reading");
+        }
+        let window = &buf.as_slice()[..expected_len];
+        match pool {
+            Some(pool) => pool.install(|| hasher.update_rayon(window)),
+            None => hasher.update_rayon(window),
+        };
+        if self.mode == CacheMode::DropBehind {
+            let offset = index * WINDOW_LEN as u64;
+            fadvise(&self.file, offset, expected_len as u64, POSIX_FADV_DONTNEED);
+        }
+        Ok(())
+    }
+
+    pub fn hash(
+        &self,
+        hasher: &mut blake3::Hasher,
+        queue_depth: usize,
+        throttle: Option<&Arc<Throttle>>,
+        pool: Option<&rayon::ThreadPool>,
+    ) -> Result<()> {
+        let num_windows = self.num_windows();
+        if num_windows <= 1 || queue_depth <= 1 {
+            // Small files don't benefit from reader threads, and there could
+            // be a lot of them.
+            let buf_len = round_up_to_alignment(std::cmp::min(self.len as usize, WINDOW_LEN));
+            let mut buf = AlignedBuffer::new(std::cmp::max(buf_len, ALIGNMENT));
+            for index in 0..num_windows {
+                if let Some(throttle) = throttle {
+                    throttle.consume(self.window_len(index) as u64);
+                }
+                let n = read_window(
+                    &*self.file,
+                    &mut buf.as_mut_slice()[..buf_len],
+                    index * WINDOW_LEN as u64,
+                    self.mode,
+                )?;
+                self.finish_window(index, &buf, n, hasher, pool)?;
+            }
+            return Ok(());
+        }
+        self.hash_queued(hasher, queue_depth, throttle, pool)
+    }
+
+    // Keep up to `queue_depth` window reads in flight on separate threads,
+    // while this thread hashes the completed windows in order. With a
+    // throttle, each reader waits for its tokens before it issues a read.
+    fn hash_queued(
+        &self,
+        hasher: &mut blake3::Hasher,
+        queue_depth: usize,
+        throttle: Option<&Arc<Throttle>>,
+        pool: Option<&rayon::ThreadPool>,
+    ) -> Result<()> {
+        let num_windows = self.num_windows();
+        let depth = std::cmp::min(queue_depth as u64, num_windows) as usize;
+        // Each reader takes a free buffer and the next window index together,
+        // under the same lock. That way the window we're waiting for always
+        // has a buffer, and the readers can't deadlock holding later windows.
+        let (free_sender, free_receiver) = mpsc::channel::<AlignedBuffer>();
+        let free_receiver = Arc::new(Mutex::new(free_receiver));
+        let (done_sender, done_receiver) = mpsc::channel();
+        let next_window = Arc::new(AtomicU64::new(0));
+        for _ in 0..depth {
+            free_sender.send(AlignedBuffer::new(WINDOW_LEN)).unwrap();
+        }
+        let mut readers = Vec::with_capacity(depth);
+        for _ in 0..depth {
+            let file = self.file.clone();
+            let free_receiver = free_receiver.clone();
+            let done_sender = done_sender.clone();
+            let next_window = next_window.clone();
+            let throttle = throttle.cloned();
+            let len = self.len;
+            let mode = self.mode;
+            readers.push(thread::spawn(move || loop {
+                let (mut buf, index) = {
+                    let free_receiver = free_receiver.lock().unwrap();
+                    let buf = match free_receiver.recv() {
+                        Ok(buf) => buf,
+                        // The hashing side has finished or given up.
+                        Err(_) => return,
+                    };
+                    (buf, next_window.fetch_add(1, Ordering::Relaxed))
+                };
+                if index >= num_windows {
+                    return;
+                }
+                if let Some(throttle) = &throttle {
+                    let offset = index * WINDOW_LEN as u64;
+                    throttle.consume(std::cmp::min(WINDOW_LEN as u64, len - offset));
+                }
+                let result =
+                    read_window(&*file, buf.as_mut_slice(), index * WINDOW_LEN as u64, mode);
+                if done_sender.send((index, buf, result)).is_err() {
+                    return;
+                }
+            }));
+        }
+        drop(done_sender);
+
+        let mut pending = BTreeMap::new();
+        let mut expected_index = 0;
+        while expected_index < num_windows {
+            let (buf, result) = match pending.remove(&expected_index) {
+                Some(window) => window,
+                None => {
+                    let (index, buf, result) = done_receiver.recv()?;
+                    pending.insert(index, (buf, result));
+                    continue;
+                }
+            };
+            // If we bail out here, dropping free_sender stops the readers.
+            self.finish_window(expected_index, &buf, result?, hasher, pool)?;
+            // The readers may already have exited after the last window.
+            let _ = free_sender.send(buf);
+            expected_index += 1;
+        }
+        drop(free_sender);
+        for reader in readers {
+            reader.join().expect("reader thread panicked");
+        }
+        Ok(())
+    }
+}
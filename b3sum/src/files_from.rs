@@ -0,0 +1,161 @@
+//! Reading the list of inputs from a file, for `--files-from` and
+//! `--files-from0`.
+//!
+//! Lists with millions of paths don't fit on a command line, and they're too
+//! big to hold in memory all at once. Here the list is read incrementally on a
+//! background thread, which also opens each file, stats it, and asks the kernel
+//! to start reading its first few megabytes (`POSIX_FADV_WILLNEED`). That
+//! thread runs up to `depth` files ahead of the hashing, through a bounded
+//! channel, so on a cold filesystem the metadata lookups and the first reads
+//! of the next files overlap with hashing the current one.
+
+use anyhow::{bail, Result};
+use std::fs::File;
+use std::io;
+use std::io::prelude::*;
+use std::path::{Path, PathBuf};
+use std::sync::mpsc;
+use std::thread;
+
+pub const DEFAULT_DEPTH: usize = 32;
+
+// How much of each file to ask the kernel to read ahead.
+#[cfg(unix)]
+const READAHEAD_LEN: u64 = 2 * 1024 * 1024;
+
+pub enum ListSource {
+    Stdin,
+    File(File),
+}
+
+/// Splits a list of paths on `separator`, either b'\n' or b'\0'. Empty
+/// entries are skipped, and the last entry doesn't need a separator.
+pub struct PathReader<R> {
+    reader: R,
+    separator: u8,
+    buf: Vec<u8>,
+}
+
+impl<R: BufRead> PathReader<R> {
+    pub fn new(reader: R, separator: u8) -> Self {
+        Self {
+            reader,
+            separator,
+            buf: Vec::new(),
+        }
+    }
+
+    #[cfg(unix)]
+    fn path_from_bytes(bytes: &[u8]) -> Result<PathBuf> {
+        use std::os::unix::ffi::OsStrExt;
+        Ok(std::ffi::OsStr::from_bytes(bytes).into())
+    }
+
+    #[cfg(not(unix))]
+    fn path_from_bytes(bytes: &[u8]) -> Result<PathBuf> {
+        match std::str::from_utf8(bytes) {
+            Ok(s) => Ok(s.into()),
+            Err(_) => bail!("Invalid UTF-8 in file list"),
+        }
+    }
+}
+
+impl<R: BufRead> Iterator for PathReader<R> {
+    type Item = Result<PathBuf>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            self.buf.clear();
+            match self.reader.read_until(self.separator, &mut self.buf) {
+                Ok(0) => return None,
+                Ok(_) => {}
+                Err(e) => return Some(Err(e.into())),
+            }
+            if self.buf.last() == Some(&self.separator) {
+                self.buf.pop();
+            }
+            if !self.buf.is_empty() {
+                return Some(Self::path_from_bytes(&self.buf));
+            }
+        }
+    }
+}
+
+/// One input from the list. `file` is None for `-`, which is read from stdin
+/// as usual, and otherwise holds the result of opening the path.
+pub struct Prefetched {
+    pub path: PathBuf,
+    pub file: Option<io::Result<File>>,
+}
+
+fn open_and_prefetch(path: &Path, readahead: bool) -> io::Result<File> {
+    let file = File::open(path)?;
+    let metadata = file.metadata()?;
+    #[cfg(unix)]
+    {
+        if readahead && metadata.is_file() {
+            crate::direct_io::fadvise(
+                &file,
+                0,
+                READAHEAD_LEN,
+                crate::direct_io::POSIX_FADV_WILLNEED,
+            );
+        }
+    }
+    #[cfg(not(unix))]
+    let _ = (readahead, metadata);
+    Ok(file)
+}
+
+fn prefetch_loop(
+    paths: impl Iterator<Item = Result<PathBuf>>,
+    list_is_stdin: bool,
+    readahead: bool,
+    sender: mpsc::SyncSender<Result<Prefetched>>,
+) {
+    for path in paths {
+        let item = path.and_then(|path| {
+            if path == Path::new("-") {
+                if list_is_stdin {
+                    bail!("Cannot read `-` when the file list is on standard input");
+                }
+                Ok(Prefetched { path, file: None })
+            } else {
+                let file = Some(open_and_prefetch(&path, readahead));
+                Ok(Prefetched { path, file })
+            }
+        });
+        let failed = item.is_err();
+        // If the receiver is gone, the hashing side has given up.
+        if sender.send(item).is_err() || failed {
+            return;
+        }
+    }
+}
+
+/// Start reading the list on a background thread, keeping up to `depth`
+/// opened files ready ahead of the caller. An error reading the list itself
+/// ends the stream. `readahead` is false with --direct-io, where filling the
+/// page cache would defeat the purpose.
+pub fn prefetch(
+    source: ListSource,
+    separator: u8,
+    depth: usize,
+    readahead: bool,
+) -> mpsc::IntoIter<Result<Prefetched>> {
+    // A zero-capacity channel would still work, but it would make the two
+    // threads take turns rather than overlap.
+    let (sender, receiver) = mpsc::sync_channel(std::cmp::max(depth, 1));
+    thread::spawn(move || match source {
+        ListSource::Stdin => {
+            let stdin = io::stdin();
+            let paths = PathReader::new(stdin.lock(), separator);
+            prefetch_loop(paths, true, readahead, sender);
+        }
+        ListSource::File(file) => {
+            let paths = PathReader::new(io::BufReader::new(file), separator);
+            prefetch_loop(paths, false, readahead, sender);
+        }
+    });
+    receiver.into_iter()
+}
@@ -1,11 +1,21 @@
 use anyhow::{bail, ensure, Context, Result};
 use clap::{App, Arg};
+use rayon::prelude::*;
 use std::cmp;
 use std::convert::TryInto;
 use std::fs::File;
 use std::io;
 use std::io::prelude::*;
 use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+#[cfg(unix)]
+mod device_queues;
+#[cfg(unix)]
+mod direct_io;
+mod files_from;
+mod manifest;
+mod throttle;
 
 #[cfg(test)]
 mod unit_tests;
@@ -22,11 +32,29 @@ const NUM_THREADS_ARG: &str = "num-threads";
 const RAW_ARG: &str = "raw";
 const CHECK_ARG: &str = "check";
 const QUIET_ARG: &str = "quiet";
+const WRITE_MANIFEST_ARG: &str = "write-manifest";
+const CHECK_MANIFEST_ARG: &str = "check-manifest";
+const LOOKUP_ARG: &str = "lookup";
+const DIRECT_IO_ARG: &str = "direct-io";
+const QUEUE_DEPTH_ARG: &str = "queue-depth";
+const MAX_RATE_ARG: &str = "max-rate";
+const MAX_CORES_ARG: &str = "max-cores";
+const DEVICE_QUEUES_ARG: &str = "device-queues";
+const FILES_FROM_ARG: &str = "files-from";
+const FILES_FROM0_ARG: &str = "files-from0";
+const PREFETCH_ARG: &str = "prefetch";
+
+// Entries from a binary manifest are verified in parallel, in batches of this
+// size, so that output stays in manifest order without buffering all of it.
+const MANIFEST_CHECK_BATCH: usize = 1024;
 
 struct Args {
     inner: clap::ArgMatches<'static>,
     file_args: Vec<PathBuf>,
     base_hasher: blake3::Hasher,
+    throttle: Option<Arc<throttle::Throttle>>,
+    #[cfg(unix)]
+    queue_depth: usize,
 }
 
 impl Args {
@@ -105,13 +133,152 @@ impl Args {
                     .conflicts_with(NO_NAMES_ARG)
                     .help("Reads BLAKE3 sums from the [file]s and checks them"),
             )
+            .arg(Arg::with_name(QUIET_ARG).long(QUIET_ARG).help(
+                "Skips printing OK for each successfully verified file.\n\
+                         Must be used with --check or --check-manifest.",
+            ))
+            .arg(
+                Arg::with_name(WRITE_MANIFEST_ARG)
+                    .long(WRITE_MANIFEST_ARG)
+                    .takes_value(true)
+                    .value_name("MANIFEST")
+                    .conflicts_with(CHECK_ARG)
+                    .conflicts_with(DERIVE_KEY_ARG)
+                    .conflicts_with(KEYED_ARG)
+                    .conflicts_with(LENGTH_ARG)
+                    .conflicts_with(RAW_ARG)
+                    .conflicts_with(NO_NAMES_ARG)
+                    .help(
+                        "Writes the hashes to a binary manifest file instead\n\
+                         of printing them. Manifests don't record the hash\n\
+                         mode, so this can't be used with --keyed or\n\
+                         --derive-key.",
+                    ),
+            )
+            .arg(
+                Arg::with_name(CHECK_MANIFEST_ARG)
+                    .long(CHECK_MANIFEST_ARG)
+                    .conflicts_with(CHECK_ARG)
+                    .conflicts_with(DERIVE_KEY_ARG)
+                    .conflicts_with(KEYED_ARG)
+                    .conflicts_with(LENGTH_ARG)
+                    .conflicts_with(RAW_ARG)
+                    .conflicts_with(NO_NAMES_ARG)
+                    .conflicts_with(WRITE_MANIFEST_ARG)
+                    .help(
+                        "Reads binary manifests from the [file]s and checks\n\
+                         them, hashing multiple files in parallel",
+                    ),
+            )
+            .arg(
+                Arg::with_name(LOOKUP_ARG)
+                    .long(LOOKUP_ARG)
+                    .takes_value(true)
+                    .multiple(true)
+                    .number_of_values(1)
+                    .value_name("PATH")
+                    .requires(CHECK_MANIFEST_ARG)
+                    .help(
+                        "Checks only the given path, found by binary search\n\
+                         rather than by scanning the manifest. Can be\n\
+                         repeated. Must be used with --check-manifest.",
+                    ),
+            )
+            .arg(Arg::with_name(DIRECT_IO_ARG).long(DIRECT_IO_ARG).help(
+                "Reads files with direct I/O, bypassing the page cache.\n\
+                 Where that isn't supported, each part of the file is\n\
+                 dropped from the cache after it's hashed. Unix only.",
+            ))
+            .arg(
+                Arg::with_name(QUEUE_DEPTH_ARG)
+                    .long(QUEUE_DEPTH_ARG)
+                    .takes_value(true)
+                    .value_name("NUM")
+                    .help(
+                        "The number of 2 MiB reads to keep in flight with\n\
+                         --direct-io (default 8), or per device with\n\
+                         --device-queues (default 4)",
+                    ),
+            )
+            .arg(
+                Arg::with_name(DEVICE_QUEUES_ARG)
+                    .long(DEVICE_QUEUES_ARG)
+                    .conflicts_with_all(&[CHECK_ARG, CHECK_MANIFEST_ARG])
+                    .help(
+                        "Groups the files by the device they're on, and reads\n\
+                         each device in its own queue: one file at a time from\n\
+                         spinning disks, and several at once from solid-state\n\
+                         drives. Hashing threads are shared. Unix only.",
+                    ),
+            )
+            .arg(
+                Arg::with_name(MAX_RATE_ARG)
+                    .long(MAX_RATE_ARG)
+                    .takes_value(true)
+                    .value_name("RATE")
+                    .help(
+                        "Limits reading and hashing to RATE bytes per second,\n\
+                         for example 200M. K, M, G, and T are powers of 1000,\n\
+                         and Ki, Mi, Gi, and Ti are powers of 1024. Prints the\n\
+                         achieved rate to stderr at the end.",
+                    ),
+            )
+            .arg(
+                Arg::with_name(MAX_CORES_ARG)
+                    .long(MAX_CORES_ARG)
+                    .takes_value(true)
+                    .value_name("NUM")
+                    .help(
+                        "Limits CPU use to NUM cores on average, for example 2\n\
+                         or 0.5. Also caps the number of threads. Prints the\n\
+                         achieved rate to stderr at the end.",
+                    ),
+            )
             .arg(
-                Arg::with_name(QUIET_ARG)
-                    .long(QUIET_ARG)
-                    .requires(CHECK_ARG)
+                Arg::with_name(FILES_FROM_ARG)
+                    .long(FILES_FROM_ARG)
+                    .takes_value(true)
+                    .value_name("LIST")
+                    .conflicts_with_all(&[
+                        FILE_ARG,
+                        FILES_FROM0_ARG,
+                        RAW_ARG,
+                        CHECK_ARG,
+                        CHECK_MANIFEST_ARG,
+                        DEVICE_QUEUES_ARG,
+                    ])
                     .help(
-                        "Skips printing OK for each successfully verified file.\n\
-                         Must be used with --check.",
+                        "Hashes the files listed in LIST, one per line, rather\n\
+                         than files given as arguments. - means standard input.\n\
+                         The list is read incrementally, so it can be very long.",
+                    ),
+            )
+            .arg(
+                Arg::with_name(FILES_FROM0_ARG)
+                    .long(FILES_FROM0_ARG)
+                    .takes_value(true)
+                    .value_name("LIST")
+                    .conflicts_with_all(&[
+                        FILE_ARG,
+                        RAW_ARG,
+                        CHECK_ARG,
+                        CHECK_MANIFEST_ARG,
+                        DEVICE_QUEUES_ARG,
+                    ])
+                    .help(
+                        "Same as --files-from, but the list is separated by NUL\n\
+                         bytes, as from `find -print0`",
+                    ),
+            )
+            .arg(
+                Arg::with_name(PREFETCH_ARG)
+                    .long(PREFETCH_ARG)
+                    .takes_value(true)
+                    .value_name("NUM")
+                    .help(
+                        "The number of files to open and start reading ahead of\n\
+                         the one being hashed, with --files-from or\n\
+                         --files-from0 (default 32)",
                     ),
             )
             // wild::args_os() is equivalent to std::env::args_os() on Unix,
@@ -125,6 +292,27 @@ impl Args {
         if inner.is_present(RAW_ARG) && file_args.len() > 1 {
             bail!("Only one filename can be provided when using --raw");
         }
+        if inner.is_present(QUIET_ARG)
+            && !inner.is_present(CHECK_ARG)
+            && !inner.is_present(CHECK_MANIFEST_ARG)
+        {
+            bail!("--quiet must be used with --check or --check-manifest");
+        }
+        if inner.is_present(QUEUE_DEPTH_ARG)
+            && !inner.is_present(DIRECT_IO_ARG)
+            && !inner.is_present(DEVICE_QUEUES_ARG)
+        {
+            bail!("--queue-depth must be used with --direct-io or --device-queues");
+        }
+        let files_from = inner
+            .value_of_os(FILES_FROM_ARG)
+            .or_else(|| inner.value_of_os(FILES_FROM0_ARG));
+        if inner.is_present(PREFETCH_ARG) && files_from.is_none() {
+            bail!("--prefetch must be used with --files-from or --files-from0");
+        }
+        if inner.is_present(KEYED_ARG) && files_from == Some("-".as_ref()) {
+            bail!("Cannot read the file list from `-` in keyed mode");
+        }
         let base_hasher = if inner.is_present(KEYED_ARG) {
             // In keyed mode, since stdin is used for the key, we can't handle
             // `-` arguments. Input::open handles that case below.
@@ -134,10 +322,46 @@ impl Args {
         } else {
             blake3::Hasher::new()
         };
+        let max_rate = match inner.value_of(MAX_RATE_ARG) {
+            Some(rate) => Some(throttle::parse_rate(rate)?),
+            None => None,
+        };
+        let max_cores = match inner.value_of(MAX_CORES_ARG) {
+            Some(cores) => {
+                let cores: f64 = cores.parse().context("Failed to parse max cores.")?;
+                if !(cores > 0.0 && cores.is_finite()) {
+                    bail!("--max-cores must be greater than zero");
+                }
+                Some(cores)
+            }
+            None => None,
+        };
+        let throttle = if max_rate.is_some() || max_cores.is_some() {
+            Some(Arc::new(throttle::Throttle::new(max_rate, max_cores)))
+        } else {
+            None
+        };
+        // Elsewhere --direct-io and --device-queues are errors, so there's
+        // nothing to check.
+        #[cfg(unix)]
+        let queue_depth = match inner.value_of(QUEUE_DEPTH_ARG) {
+            Some(depth) => {
+                let depth: usize = depth.parse().context("Failed to parse queue depth.")?;
+                if depth == 0 {
+                    bail!("--queue-depth must be greater than zero");
+                }
+                depth
+            }
+            None if inner.is_present(DEVICE_QUEUES_ARG) => device_queues::DEFAULT_DEPTH,
+            None => direct_io::DEFAULT_QUEUE_DEPTH,
+        };
         Ok(Self {
             inner,
             file_args,
             base_hasher,
+            throttle,
+            #[cfg(unix)]
+            queue_depth,
         })
     }
 
@@ -184,6 +408,64 @@ impl Args {
     fn quiet(&self) -> bool {
         self.inner.is_present(QUIET_ARG)
     }
+
+    fn write_manifest(&self) -> Option<&Path> {
+        self.inner.value_of_os(WRITE_MANIFEST_ARG).map(Path::new)
+    }
+
+    fn check_manifest(&self) -> bool {
+        self.inner.is_present(CHECK_MANIFEST_ARG)
+    }
+
+    fn direct_io(&self) -> bool {
+        self.inner.is_present(DIRECT_IO_ARG)
+    }
+
+    // The source of the file list, and its separator, if there is one.
+    fn files_from(&self) -> Result<Option<(files_from::ListSource, u8)>> {
+        let (list, separator) = if let Some(list) = self.inner.value_of_os(FILES_FROM_ARG) {
+            (list, b'\n')
+        } else if let Some(list) = self.inner.value_of_os(FILES_FROM0_ARG) {
+            (list, b'\0')
+        } else {
+            return Ok(None);
+        };
+        let source = if list == "-" {
+            files_from::ListSource::Stdin
+        } else {
+            let file = File::open(list)
+                .with_context(|| format!("Failed to open {}", list.to_string_lossy()))?;
+            files_from::ListSource::File(file)
+        };
+        Ok(Some((source, separator)))
+    }
+
+    fn prefetch(&self) -> Result<usize> {
+        if let Some(depth) = self.inner.value_of(PREFETCH_ARG) {
+            depth.parse().context("Failed to parse prefetch.")
+        } else {
+            Ok(files_from::DEFAULT_DEPTH)
+        }
+    }
+
+    fn device_queues(&self) -> bool {
+        self.inner.is_present(DEVICE_QUEUES_ARG)
+    }
+
+    #[cfg(unix)]
+    fn queue_depth(&self) -> usize {
+        self.queue_depth
+    }
+
+    fn throttle(&self) -> Option<&throttle::Throttle> {
+        self.throttle.as_deref()
+    }
+
+    fn lookup_paths(&self) -> Option<Vec<String>> {
+        self.inner
+            .values_of_os(LOOKUP_ARG)
+            .map(|iter| iter.map(|s| s.to_string_lossy().into_owned()).collect())
+    }
 }
 
 enum Input {
@@ -203,7 +485,10 @@ impl Input {
             }
             return Ok(Self::Stdin);
         }
-        let file = File::open(path)?;
+        Self::from_file(File::open(path)?, args)
+    }
+
+    fn from_file(file: File, args: &Args) -> Result<Self> {
         if !args.no_mmap() {
             if let Some(mmap) = maybe_memmap_file(&file)? {
                 return Ok(Self::Mmap(io::Cursor::new(mmap)));
@@ -218,9 +503,17 @@ impl Input {
             // The fast path: If we mmapped the file successfully, hash using
             // multiple threads. This doesn't work on stdin, or on some files,
             // and it can also be disabled with --no-mmap.
-            Self::Mmap(cursor) => {
-                hasher.update_rayon(cursor.get_ref());
-            }
+            Self::Mmap(cursor) => match args.throttle() {
+                Some(throttle) => {
+                    for slice in cursor.get_ref().chunks(throttle::SLICE_LEN) {
+                        throttle.consume(slice.len() as u64);
+                        hasher.update_rayon(slice);
+                    }
+                }
+                None => {
+                    hasher.update_rayon(cursor.get_ref());
+                }
+            },
             // The slower paths, for stdin or files we didn't/couldn't mmap.
             // This is currently all single-threaded. Doing multi-threaded
             // hashing without memory mapping is tricky, since all your worker
@@ -231,12 +524,12 @@ impl Input {
             // one. We might implement that in the future, but since this is
             // the slow path anyway, it's not high priority.
             Self::File(file) => {
-                copy_wide(file, &mut hasher)?;
+                copy_wide(file, &mut hasher, args.throttle())?;
             }
             Self::Stdin => {
                 let stdin = io::stdin();
                 let lock = stdin.lock();
-                copy_wide(lock, &mut hasher)?;
+                copy_wide(lock, &mut hasher, args.throttle())?;
             }
         }
         Ok(hasher.finalize_xof())
@@ -257,13 +550,20 @@ impl Read for Input {
 // that we support, but `std::io::copy` currently uses 8 KiB. Most platforms
 // can support at least 64 KiB, and there's some performance benefit to using
 // bigger reads, so that's what we use here.
-fn copy_wide(mut reader: impl Read, hasher: &mut blake3::Hasher) -> io::Result<u64> {
+fn copy_wide(
+    mut reader: impl Read,
+    hasher: &mut blake3::Hasher,
+    throttle: Option<&throttle::Throttle>,
+) -> io::Result<u64> {
     let mut buffer = [0; 65536];
     let mut total = 0;
     loop {
         match reader.read(&mut buffer) {
             Ok(0) => return Ok(total),
             Ok(n) => {
+                if let Some(throttle) = throttle {
+                    throttle.consume(n as u64);
+                }
                 hasher.update(&buffer[..n]);
                 total += n as u64;
             }
@@ -352,8 +652,8 @@ struct FilepathString {
     is_escaped: bool,
 }
 
-// returns (string, did_escape)
-fn filepath_to_string(filepath: &Path) -> FilepathString {
+// The unescaped form of a path, as stored in checkfiles and manifests.
+fn normalized_filepath_string(filepath: &Path) -> String {
     let unicode_cow = filepath.to_string_lossy();
     let mut filepath_string = unicode_cow.to_string();
     // If we're on Windows, normalize backslashes to forward slashes. This
@@ -365,6 +665,12 @@ fn filepath_to_string(filepath: &Path) -> FilepathString {
     if cfg!(windows) {
         filepath_string = filepath_string.replace('\\', "/");
     }
+    filepath_string
+}
+
+// returns (string, did_escape)
+fn filepath_to_string(filepath: &Path) -> FilepathString {
+    let mut filepath_string = normalized_filepath_string(filepath);
     let mut is_escaped = false;
     if filepath_string.contains('\\') || filepath_string.contains('\n') {
         filepath_string = filepath_string.replace('\\', "\\\\").replace('\n', "\\n");
@@ -495,9 +801,55 @@ fn parse_check_line(mut line: &str) -> Result<ParsedCheckLine> {
     })
 }
 
-fn hash_one_input(path: &Path, args: &Args) -> Result<()> {
-    let mut input = Input::open(path, args)?;
-    let output = input.hash(args)?;
+// Open and hash one input. With --direct-io, regular files are read around
+// the page cache. Everything else, including stdin, is read the usual way.
+fn hash_path(path: &Path, args: &Args) -> Result<blake3::OutputReader> {
+    if args.direct_io() && path != Path::new("-") {
+        #[cfg(unix)]
+        {
+            if let Some(direct_file) = direct_io::DirectFile::open(path)? {
+                let mut hasher = args.base_hasher.clone();
+                direct_file.hash(
+                    &mut hasher,
+                    args.queue_depth(),
+                    args.throttle.as_ref(),
+                    None,
+                )?;
+                return Ok(hasher.finalize_xof());
+            }
+        }
+        #[cfg(not(unix))]
+        bail!("--direct-io is not supported on this platform");
+    }
+    Input::open(path, args)?.hash(args)
+}
+
+// Hash an input that the --files-from prefetcher has already opened.
+fn hash_prefetched(
+    prefetched: files_from::Prefetched,
+    args: &Args,
+) -> Result<blake3::OutputReader> {
+    match prefetched.file {
+        // --direct-io needs to open the file its own way.
+        Some(Ok(_)) if args.direct_io() => hash_path(&prefetched.path, args),
+        Some(Ok(file)) => Input::from_file(file, args)?.hash(args),
+        Some(Err(e)) => Err(e.into()),
+        None => hash_path(&prefetched.path, args),
+    }
+}
+
+// Print one hashed input, or add it to the manifest that we're writing.
+fn finish_one_input(
+    path: &Path,
+    output: Result<blake3::OutputReader>,
+    args: &Args,
+    manifest_writer: Option<&mut manifest::ManifestWriter>,
+) -> Result<()> {
+    let output = output?;
+    if let Some(writer) = manifest_writer {
+        writer.push(normalized_filepath_string(path), default_len_digest(output));
+        return Ok(());
+    }
     if args.raw() {
         write_raw_output(output, args)?;
         return Ok(());
@@ -519,6 +871,43 @@ fn hash_one_input(path: &Path, args: &Args) -> Result<()> {
     Ok(())
 }
 
+// The default-length hash, as stored in checkfiles and manifests.
+fn default_len_digest(mut output: blake3::OutputReader) -> blake3::Hash {
+    let mut hash_bytes = [0; blake3::OUT_LEN];
+    output.fill(&mut hash_bytes);
+    hash_bytes.into()
+}
+
+fn hash_one_digest(file_path: &Path, args: &Args) -> Result<blake3::Hash> {
+    Ok(default_len_digest(hash_path(file_path, args)?))
+}
+
+// Print the OK/FAILED line for one checked file. Returns true for success.
+fn report_check(
+    file_string: &str,
+    expected_hash: &blake3::Hash,
+    hash_result: Result<blake3::Hash>,
+    args: &Args,
+) -> bool {
+    let found_hash: blake3::Hash = match hash_result {
+        Ok(hash) => hash,
+        Err(e) => {
+            println!("{}: FAILED ({})", file_string, e);
+            return false;
+        }
+    };
+    // This is a constant-time comparison.
+    if *expected_hash == found_hash {
+        if !args.quiet() {
+            println!("{}: OK", file_string);
+        }
+        true
+    } else {
+        println!("{}: FAILED", file_string);
+        false
+    }
+}
+
 // Returns true for success. Having a boolean return value here, instead of
 // passing down the some_file_failed reference, makes it less likely that we
 // might forget to set it in some error condition.
@@ -541,30 +930,8 @@ fn check_one_line(line: &str, args: &Args) -> bool {
     } else {
         file_string
     };
-    let hash_result: Result<blake3::Hash> = Input::open(&file_path, args)
-        .and_then(|mut input| input.hash(args))
-        .map(|mut hash_output| {
-            let mut found_hash_bytes = [0; blake3::OUT_LEN];
-            hash_output.fill(&mut found_hash_bytes);
-            found_hash_bytes.into()
-        });
-    let found_hash: blake3::Hash = match hash_result {
-        Ok(hash) => hash,
-        Err(e) => {
-            println!("{}: FAILED ({})", file_string, e);
-            return false;
-        }
-    };
-    // This is a constant-time comparison.
-    if expected_hash == found_hash {
-        if !args.quiet() {
-            println!("{}: OK", file_string);
-        }
-        true
-    } else {
-        println!("{}: FAILED", file_string);
-        false
-    }
+    let hash_result = hash_one_digest(&file_path, args);
+    report_check(&file_string, &expected_hash, hash_result, args)
 }
 
 fn check_one_checkfile(path: &Path, args: &Args, some_file_failed: &mut bool) -> Result<()> {
@@ -586,36 +953,181 @@ fn check_one_checkfile(path: &Path, args: &Args, some_file_failed: &mut bool) ->
     }
 }
 
+// Verify a batch of manifest entries in parallel, and then report the results
+// in order. Returns true if every entry succeeded.
+fn check_manifest_batch(entries: Vec<Result<manifest::ManifestEntry>>, args: &Args) -> bool {
+    let results: Vec<Result<(manifest::ManifestEntry, Result<blake3::Hash>)>> = entries
+        .into_par_iter()
+        .map(|entry| -> Result<_> {
+            let entry = entry?;
+            check_for_invalid_characters(entry.path)?;
+            let hash_result = hash_one_digest(Path::new(entry.path), args);
+            Ok((entry, hash_result))
+        })
+        .collect();
+    let mut all_succeeded = true;
+    for result in results {
+        let (entry, hash_result) = match result {
+            Ok(checked) => checked,
+            Err(e) => {
+                eprintln!("{}: {}", NAME, e);
+                all_succeeded = false;
+                continue;
+            }
+        };
+        let FilepathString {
+            filepath_string,
+            is_escaped,
+        } = filepath_to_string(Path::new(entry.path));
+        let file_string = if is_escaped {
+            "\\".to_string() + &filepath_string
+        } else {
+            filepath_string
+        };
+        if !report_check(&file_string, &entry.expected_hash, hash_result, args) {
+            all_succeeded = false;
+        }
+    }
+    all_succeeded
+}
+
+fn check_one_manifest(path: &Path, args: &Args, some_file_failed: &mut bool) -> Result<()> {
+    // Use the memory map directly if we got one. Otherwise (stdin, or a
+    // manifest too small to be worth mapping) read the whole thing.
+    let mut manifest_input = Input::open(path, args)?;
+    let mut buffer = Vec::new();
+    if !matches!(manifest_input, Input::Mmap(_)) {
+        manifest_input.read_to_end(&mut buffer)?;
+    }
+    let bytes: &[u8] = match &manifest_input {
+        Input::Mmap(cursor) => cursor.get_ref(),
+        _ => &buffer,
+    };
+    let manifest = manifest::Manifest::parse(bytes)?;
+    if let Some(lookup_paths) = args.lookup_paths() {
+        let entries = lookup_paths
+            .iter()
+            .map(|lookup_path| match manifest.lookup(lookup_path) {
+                Ok(Some(entry)) => Ok(entry),
+                Ok(None) => bail!("{}: Not found in manifest", lookup_path),
+                Err(e) => Err(e),
+            })
+            .collect();
+        if !check_manifest_batch(entries, args) {
+            *some_file_failed = true;
+        }
+        return Ok(());
+    }
+    let mut batch_start = 0;
+    while batch_start < manifest.len() {
+        let batch_end = cmp::min(batch_start + MANIFEST_CHECK_BATCH, manifest.len());
+        let entries = (batch_start..batch_end)
+            .map(|i| manifest.entry(i))
+            .collect();
+        if !check_manifest_batch(entries, args) {
+            *some_file_failed = true;
+        }
+        batch_start = batch_end;
+    }
+    Ok(())
+}
+
+// The number of threads a default ThreadPoolBuilder would use. Asking rayon
+// directly with current_num_threads() would start its global pool, which we
+// never use.
+fn default_num_threads() -> usize {
+    if let Some(n) = std::env::var("RAYON_NUM_THREADS")
+        .ok()
+        .and_then(|s| s.parse().ok())
+        .filter(|&n| n > 0)
+    {
+        return n;
+    }
+    std::thread::available_parallelism().map_or(1, |n| n.get())
+}
+
 fn main() -> Result<()> {
-    let args = Args::parse()?;
+    let args = Arc::new(Args::parse()?);
     let mut thread_pool_builder = rayon::ThreadPoolBuilder::new();
-    if let Some(num_threads) = args.num_threads()? {
+    let mut num_threads = args.num_threads()?;
+    if let Some(throttle) = args.throttle() {
+        // Zero means the default, same as in ThreadPoolBuilder.
+        let available = match num_threads {
+            Some(n) if n > 0 => n,
+            _ => default_num_threads(),
+        };
+        num_threads = Some(throttle.pool_size(available));
+    }
+    if let Some(num_threads) = num_threads {
         thread_pool_builder = thread_pool_builder.num_threads(num_threads);
     }
-    let thread_pool = thread_pool_builder.build()?;
-    thread_pool.install(|| {
-        let mut some_file_failed = false;
-        // Note that file_args automatically includes `-` if nothing is given.
-        for path in &args.file_args {
-            if args.check() {
+    let thread_pool = Arc::new(thread_pool_builder.build()?);
+    let mut some_file_failed = false;
+    let mut manifest_writer = args
+        .write_manifest()
+        .map(|_| manifest::ManifestWriter::new());
+    if args.check() || args.check_manifest() {
+        thread_pool.install(|| -> Result<()> {
+            // Note that file_args automatically includes `-` if nothing is
+            // given.
+            for path in &args.file_args {
                 // A hash mismatch or a failure to read a hashed file will be
                 // printed in the checkfile loop, and will not propagate here.
                 // This is similar to the explicit error handling we do in the
-                // hashing case immediately below. In these cases,
-                // some_file_failed will be set to false.
-                check_one_checkfile(path, &args, &mut some_file_failed)?;
-            } else {
-                // Errors encountered in hashing are tolerated and printed to
-                // stderr. This allows e.g. `b3sum *` to print errors for
-                // non-files and keep going. However, if we encounter any
-                // errors we'll still return non-zero at the end.
-                let result = hash_one_input(path, &args);
-                if let Err(e) = result {
-                    some_file_failed = true;
-                    eprintln!("{}: {}: {}", NAME, path.to_string_lossy(), e);
+                // hashing case below. In these cases, some_file_failed will be
+                // set to false.
+                if args.check() {
+                    check_one_checkfile(path, &args, &mut some_file_failed)?;
+                } else {
+                    check_one_manifest(path, &args, &mut some_file_failed)?;
                 }
             }
+            Ok(())
+        })?;
+    } else {
+        // Errors encountered in hashing are tolerated and printed to stderr.
+        // This allows e.g. `b3sum *` to print errors for non-files and keep
+        // going. However, if we encounter any errors we'll still return
+        // non-zero at the end.
+        let mut finish = |path: &Path, output| {
+            if let Err(e) = finish_one_input(path, output, &args, manifest_writer.as_mut()) {
+                some_file_failed = true;
+                eprintln!("{}: {}: {}", NAME, path.to_string_lossy(), e);
+            }
+        };
+        if let Some((list, separator)) = args.files_from()? {
+            let depth = args.prefetch()?;
+            thread_pool.install(|| -> Result<()> {
+                for prefetched in files_from::prefetch(list, separator, depth, !args.direct_io()) {
+                    // An error reading the list itself is fatal.
+                    let prefetched = prefetched?;
+                    let path = prefetched.path.clone();
+                    finish(&path, hash_prefetched(prefetched, &args));
+                }
+                Ok(())
+            })?;
+        } else if args.device_queues() {
+            // The device queues hash on the pool from their own threads. This
+            // thread only waits and prints, so it stays out of the pool.
+            #[cfg(unix)]
+            device_queues::hash_all(&args, &thread_pool, args.queue_depth(), &mut finish);
+            #[cfg(not(unix))]
+            bail!("--device-queues is not supported on this platform");
+        } else {
+            thread_pool.install(|| {
+                for path in &args.file_args {
+                    finish(path, hash_path(path, &args));
+                }
+            });
         }
-        std::process::exit(if some_file_failed { 1 } else { 0 });
-    })
+    }
+    if let (Some(writer), Some(manifest_path)) = (manifest_writer, args.write_manifest()) {
+        let file = File::create(manifest_path)
+            .with_context(|| format!("Failed to create {}", manifest_path.to_string_lossy()))?;
+        writer.write_to(io::BufWriter::new(file))?;
+    }
+    if let Some(throttle) = args.throttle() {
+        eprintln!("{}: {}", NAME, throttle.report());
+    }
+    std::process::exit(if some_file_failed { 1 } else { 0 });
 }
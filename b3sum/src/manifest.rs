@@ -0,0 +1,176 @@
+//! A compact binary alternative to the text checkfile format.
+//!
+//! Text checkfiles have to be parsed line by line, with hex decoding and
+//! unescaping for every entry, and there's no way to find one path without
+//! scanning the whole file. A manifest instead stores raw digests in a table of
+//! fixed-size entries, sorted by path, which can be memory mapped and binary
+//! searched directly. The layout, with all integers little-endian, is:
+//!
+//! ```text
+//! header (32 bytes):
+//!     magic        8 bytes   "B3MANIF\0"
+//!     version      u32       currently 1
+//!     reserved     u32       must be 0
+//!     entry_count  u64
+//!     names_len    u64       total length of the names region
+//! entries (entry_count * 48 bytes, sorted by path bytes):
+//!     hash         32 bytes
+//!     name_offset  u64       offset into the names region
+//!     name_len     u64
+//! names (names_len bytes):
+//!     UTF-8 paths, concatenated with no separators
+//! ```
+//!
+//! Paths are stored unescaped, in the same normalized form that the text
+//! format prints (forward slashes on Windows). They go through the same
+//! invalid character checks as checkfile paths when they're verified.
+
+use anyhow::{bail, ensure, Result};
+use std::convert::TryInto;
+use std::io;
+use std::io::prelude::*;
+
+pub const MAGIC: &[u8; 8] = b"B3MANIF\0";
+pub const VERSION: u32 = 1;
+pub const HEADER_LEN: usize = 32;
+pub const ENTRY_LEN: usize = blake3::OUT_LEN + 16;
+
+fn read_u32(bytes: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(bytes[offset..][..4].try_into().unwrap())
+}
+
+fn read_u64(bytes: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(bytes[offset..][..8].try_into().unwrap())
+}
+
+/// Collects (path, hash) pairs in hash mode, and writes them out sorted.
+pub struct ManifestWriter {
+    entries: Vec<(String, blake3::Hash)>,
+}
+
+impl ManifestWriter {
+    pub fn new() -> Self {
+        Self {
+            entries: Vec::new(),
+        }
+    }
+
+    pub fn push(&mut self, path: String, hash: blake3::Hash) {
+        self.entries.push((path, hash));
+    }
+
+    pub fn write_to(mut self, mut writer: impl Write) -> io::Result<()> {
+        // A stable sort keeps duplicate paths in command line order. Lookups
+        // will find one of them, and a full check will verify all of them.
+        self.entries
+            .sort_by(|a, b| a.0.as_bytes().cmp(b.0.as_bytes()));
+        let names_len: u64 = self.entries.iter().map(|e| e.0.len() as u64).sum();
+        writer.write_all(MAGIC)?;
+        writer.write_all(&VERSION.to_le_bytes())?;
+        writer.write_all(&0u32.to_le_bytes())?;
+        writer.write_all(&(self.entries.len() as u64).to_le_bytes())?;
+        writer.write_all(&names_len.to_le_bytes())?;
+        let mut name_offset = 0u64;
+        for (path, hash) in &self.entries {
+            writer.write_all(hash.as_bytes())?;
+            writer.write_all(&name_offset.to_le_bytes())?;
+            writer.write_all(&(path.len() as u64).to_le_bytes())?;
+            name_offset += path.len() as u64;
+        }
+        for (path, _) in &self.entries {
+            writer.write_all(path.as_bytes())?;
+        }
+        writer.flush()
+    }
+}
+
+#[derive(Debug)]
+pub struct ManifestEntry<'a> {
+    pub path: &'a str,
+    pub expected_hash: blake3::Hash,
+}
+
+/// A read-only view of a manifest. This only validates the header up front,
+/// so that opening a huge memory-mapped manifest doesn't touch every page.
+/// Individual entries are validated as they're read.
+#[derive(Debug)]
+pub struct Manifest<'a> {
+    entries: &'a [u8],
+    names: &'a [u8],
+}
+
+impl<'a> Manifest<'a> {
+    pub fn parse(bytes: &'a [u8]) -> Result<Self> {
+        ensure!(bytes.len() >= HEADER_LEN, "Short manifest");
+        ensure!(&bytes[..MAGIC.len()] == MAGIC, "Not a b3sum manifest");
+        let version = read_u32(bytes, 8);
+        ensure!(
+            version == VERSION,
+            "Unsupported manifest version {}",
+            version
+        );
+        ensure!(read_u32(bytes, 12) == 0, "Invalid manifest header");
+        let entry_count = read_u64(bytes, 16);
+        let names_len = read_u64(bytes, 24);
+        let entries_len = entry_count
+            .checked_mul(ENTRY_LEN as u64)
+            .filter(|&n| n <= (bytes.len() - HEADER_LEN) as u64);
+        let entries_len = match entries_len {
+            Some(n) => n as usize,
+            None => bail!("Truncated manifest"),
+        };
+        let names = &bytes[HEADER_LEN + entries_len..];
+        ensure!(names.len() as u64 == names_len, "Truncated manifest");
+        Ok(Self {
+            entries: &bytes[HEADER_LEN..][..entries_len],
+            names,
+        })
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len() / ENTRY_LEN
+    }
+
+    fn name(&self, index: usize) -> Result<&'a [u8]> {
+        let entry = &self.entries[index * ENTRY_LEN..][..ENTRY_LEN];
+        let offset = read_u64(entry, blake3::OUT_LEN);
+        let len = read_u64(entry, blake3::OUT_LEN + 8);
+        match offset.checked_add(len) {
+            Some(end) if end <= self.names.len() as u64 => {
+                Ok(&self.names[offset as usize..end as usize])
+            }
+            _ => bail!("Invalid manifest entry"),
+        }
+    }
+
+    pub fn entry(&self, index: usize) -> Result<ManifestEntry<'a>> {
+        let entry = &self.entries[index * ENTRY_LEN..][..ENTRY_LEN];
+        let hash_bytes: [u8; blake3::OUT_LEN] = entry[..blake3::OUT_LEN].try_into().unwrap();
+        let path = match std::str::from_utf8(self.name(index)?) {
+            Ok(path) => path,
+            Err(_) => bail!("Invalid UTF-8 in manifest path"),
+        };
+        ensure!(!path.is_empty(), "Empty path");
+        Ok(ManifestEntry {
+            path,
+            expected_hash: hash_bytes.into(),
+        })
+    }
+
+    /// Binary search for a path. Only the entries along the search path are
+    /// touched. If the manifest isn't actually sorted, this can fail to find
+    /// an entry that's present, but it can't return the wrong one.
+    pub fn lookup(&self, path: &str) -> Result<Option<ManifestEntry<'a>>> {
+        let mut low = 0;
+        let mut high = self.len();
+        while low < high {
+            let mid = low + (high - low) / 2;
+            match self.name(mid)?.cmp(path.as_bytes()) {
+                std::cmp::Ordering::Less => low = mid + 1,
+                std::cmp::Ordering::Greater => high = mid,
+                std::cmp::Ordering::Equal => return self.entry(mid).map(Some),
+            }
+        }
+        Ok(None)
+    }
+}
@@ -0,0 +1,179 @@
+//! Bandwidth and CPU budgets, for `--max-rate` and `--max-cores`.
+//!
+//! Every read path (mmap, buffered, and direct I/O) takes tokens from a
+//! shared bucket before it reads or hashes each slice of input. Tokens refill
+//! at the configured byte rate, and the bucket holds at most a tenth of a
+//! second of them, so short bursts are allowed but the long-run rate is capped.
+//! On Unix the CPU budget is enforced the same way: if the process has used
+//! more CPU time than `max_cores` times the elapsed wall time, readers sleep
+//! until it's back under budget. The thread pool is also sized to the budget,
+//! so that we don't spin up more hashing threads than we're allowed to use.
+
+use anyhow::{bail, Context, Result};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+// Inputs are fed to the hasher in slices of this size when throttling is
+// enabled, so that pacing is smooth even for large memory-mapped files.
+pub const SLICE_LEN: usize = 1 << 20;
+
+// Parse a byte rate like "200M" or "1.5Gi". Plain suffixes are powers of 1000,
+// and suffixes ending in "i" are powers of 1024. A trailing "B" or "B/s" is
+// allowed.
+pub fn parse_rate(s: &str) -> Result<f64> {
+    let trimmed = s.trim_end_matches("/s").trim_end_matches('B');
+    let split = trimmed
+        .find(|c: char| c.is_ascii_alphabetic())
+        .unwrap_or(trimmed.len());
+    let (number, suffix) = trimmed.split_at(split);
+    let multiplier: f64 = match suffix {
+        "" => 1.0,
+        "K" | "k" => 1e3,
+        "M" => 1e6,
+        "G" => 1e9,
+        "T" => 1e12,
+        "Ki" => 1024.0,
+        "Mi" => 1024.0 * 1024.0,
+        "Gi" => 1024.0 * 1024.0 * 1024.0,
+        "Ti" => 1024.0 * 1024.0 * 1024.0 * 1024.0,
+        _ => bail!("Unknown rate suffix {:?}", suffix),
+    };
+    let number: f64 = number.parse().context("Failed to parse rate.")?;
+    let rate = number * multiplier;
+    if !(rate >= 1.0 && rate.is_finite()) {
+        bail!("Rate must be at least 1 byte per second");
+    }
+    Ok(rate)
+}
+
+#[cfg(unix)]
+fn cpu_time() -> Option<Duration> {
+    let mut usage = std::mem::MaybeUninit::<libc::rusage>::uninit();
+    if unsafe { libc::getrusage(libc::RUSAGE_SELF, usage.as_mut_ptr()) } != 0 {
+        return None;
+    }
+    let usage = unsafe { usage.assume_init() };
+    let to_duration = |t: libc::timeval| {
+        Duration::from_secs(t.tv_sec as u64) + Duration::from_micros(t.tv_usec as u64)
+    };
+    Some(to_duration(usage.ru_utime) + to_duration(usage.ru_stime))
+}
+
+// Without getrusage, the CPU budget is only enforced through the size of the
+// thread pool.
+#[cfg(not(unix))]
+fn cpu_time() -> Option<Duration> {
+    None
+}
+
+struct Bucket {
+    tokens: f64,
+    last_refill: Instant,
+    total_bytes: u64,
+}
+
+pub struct Throttle {
+    max_rate: Option<f64>,
+    max_cores: Option<f64>,
+    start: Instant,
+    start_cpu: Option<Duration>,
+    bucket: Mutex<Bucket>,
+}
+
+impl Throttle {
+    pub fn new(max_rate: Option<f64>, max_cores: Option<f64>) -> Self {
+        let start = Instant::now();
+        let capacity = Self::capacity(max_rate);
+        Self {
+            max_rate,
+            max_cores,
+            start,
+            start_cpu: cpu_time(),
+            bucket: Mutex::new(Bucket {
+                tokens: capacity,
+                last_refill: start,
+                total_bytes: 0,
+            }),
+        }
+    }
+
+    fn capacity(max_rate: Option<f64>) -> f64 {
+        match max_rate {
+            Some(rate) => (rate / 10.0).max(SLICE_LEN as f64),
+            None => 0.0,
+        }
+    }
+
+    /// Block until we're allowed to read and hash another `bytes` bytes. This
+    /// takes the tokens up front, possibly going into debt, so that
+    /// concurrent callers queue up behind each other rather than all waking
+    /// up at once.
+    pub fn consume(&self, bytes: u64) {
+        let mut delay = Duration::from_secs(0);
+        {
+            let mut bucket = self.bucket.lock().unwrap();
+            bucket.total_bytes += bytes;
+            if let Some(rate) = self.max_rate {
+                let now = Instant::now();
+                let refill = now.duration_since(bucket.last_refill).as_secs_f64() * rate;
+                bucket.tokens = (bucket.tokens + refill).min(Self::capacity(self.max_rate));
+                bucket.last_refill = now;
+                bucket.tokens -= bytes as f64;
+                if bucket.tokens < 0.0 {
+                    delay = Duration::from_secs_f64(-bucket.tokens / rate);
+                }
+            }
+        }
+        if let (Some(cores), Some(start_cpu), Some(now_cpu)) =
+            (self.max_cores, self.start_cpu, cpu_time())
+        {
+            // The wall time that the CPU time we've used so far would take at
+            // the budgeted number of cores.
+            let budgeted = now_cpu.saturating_sub(start_cpu).as_secs_f64() / cores;
+            let elapsed = self.start.elapsed().as_secs_f64();
+            if budgeted > elapsed {
+                delay = delay.max(Duration::from_secs_f64(budgeted - elapsed));
+            }
+        }
+        if delay > Duration::from_secs(0) {
+            std::thread::sleep(delay);
+        }
+    }
+
+    /// The number of hashing threads worth starting, given the number we'd
+    /// use without a budget. A core budget rounds up to whole threads. A rate
+    /// budget is converted to threads by timing a short single-threaded hash,
+    /// so a slow rate on a fast machine doesn't wake up every core.
+    pub fn pool_size(&self, available: usize) -> usize {
+        let mut threads = available;
+        if let Some(cores) = self.max_cores {
+            threads = threads.min(cores.ceil() as usize);
+        }
+        if let Some(rate) = self.max_rate {
+            let input = vec![0; SLICE_LEN];
+            let start = Instant::now();
+            blake3::hash(&input);
+            let seconds = start.elapsed().as_secs_f64().max(1e-6);
+            let per_thread_rate = SLICE_LEN as f64 / seconds;
+            threads = threads.min((rate / per_thread_rate).ceil() as usize);
+        }
+        threads.max(1)
+    }
+
+    /// A summary of the achieved throughput and CPU use, for stderr.
+    pub fn report(&self) -> String {
+        let total_bytes = self.bucket.lock().unwrap().total_bytes;
+        let seconds = self.start.elapsed().as_secs_f64();
+        let mut report = format!(
+            "hashed {} bytes in {:.2}s ({:.1} MB/s)",
+            total_bytes,
+            seconds,
+            total_bytes as f64 / seconds.max(1e-9) / 1e6,
+        );
+        if let (Some(start_cpu), Some(now_cpu)) = (self.start_cpu, cpu_time()) {
+            let cores = now_cpu.saturating_sub(start_cpu).as_secs_f64() / seconds.max(1e-9);
+            report += &format!(", {:.2} cores", cores);
+        }
+        report
+    }
+}
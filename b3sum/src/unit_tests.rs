@@ -1,4 +1,4 @@
-use std::path::Path;
+use std::path::{Path, PathBuf};
 
 #[test]
 fn test_parse_check_line() {
@@ -187,3 +187,254 @@ fn test_parse_check_line() {
         .unwrap_err();
     }
 }
+
+#[test]
+fn test_manifest_round_trip() {
+    let mut writer = crate::manifest::ManifestWriter::new();
+    writer.push("c/d".into(), blake3::hash(b"cd"));
+    writer.push("a".into(), blake3::hash(b"a"));
+    writer.push("否认".into(), blake3::hash(b"non-ascii"));
+    writer.push("b".into(), blake3::hash(b"b"));
+    let mut bytes = Vec::new();
+    writer.write_to(&mut bytes).unwrap();
+    assert_eq!(
+        bytes.len(),
+        crate::manifest::HEADER_LEN
+            + 4 * crate::manifest::ENTRY_LEN
+            + "a".len()
+            + "b".len()
+            + "c/d".len()
+            + "否认".len(),
+    );
+
+    let manifest = crate::manifest::Manifest::parse(&bytes).unwrap();
+    assert_eq!(manifest.len(), 4);
+    // Entries come back sorted by path.
+    let paths: Vec<&str> = (0..manifest.len())
+        .map(|i| manifest.entry(i).unwrap().path)
+        .collect();
+    assert_eq!(paths, ["a", "b", "c/d", "否认"]);
+    assert_eq!(
+        manifest.entry(2).unwrap().expected_hash,
+        blake3::hash(b"cd")
+    );
+
+    // Every path can be found by lookup, and missing paths aren't found.
+    for (path, input) in &[("a", "a"), ("b", "b"), ("c/d", "cd"), ("否认", "non-ascii")] {
+        let entry = manifest.lookup(path).unwrap().unwrap();
+        assert_eq!(entry.path, *path);
+        assert_eq!(entry.expected_hash, blake3::hash(input.as_bytes()));
+    }
+    assert!(manifest.lookup("").unwrap().is_none());
+    assert!(manifest.lookup("c").unwrap().is_none());
+    assert!(manifest.lookup("zzz").unwrap().is_none());
+
+    // An empty manifest is valid.
+    let mut empty_bytes = Vec::new();
+    crate::manifest::ManifestWriter::new()
+        .write_to(&mut empty_bytes)
+        .unwrap();
+    let empty = crate::manifest::Manifest::parse(&empty_bytes).unwrap();
+    assert_eq!(empty.len(), 0);
+    assert!(empty.lookup("a").unwrap().is_none());
+}
+
+#[test]
+fn test_manifest_invalid() {
+    let mut writer = crate::manifest::ManifestWriter::new();
+    writer.push("foo".into(), blake3::hash(b"foo"));
+    let mut bytes = Vec::new();
+    writer.write_to(&mut bytes).unwrap();
+    crate::manifest::Manifest::parse(&bytes).unwrap();
+
+    // too short
+    crate::manifest::Manifest::parse(&bytes[..crate::manifest::HEADER_LEN - 1]).unwrap_err();
+    // truncated names
+    crate::manifest::Manifest::parse(&bytes[..bytes.len() - 1]).unwrap_err();
+    // trailing garbage
+    let mut long_bytes = bytes.clone();
+    long_bytes.push(0);
+    crate::manifest::Manifest::parse(&long_bytes).unwrap_err();
+    // bad magic
+    let mut bad_magic = bytes.clone();
+    bad_magic[0] ^= 1;
+    crate::manifest::Manifest::parse(&bad_magic).unwrap_err();
+    // unknown version
+    let mut bad_version = bytes.clone();
+    bad_version[8] = 2;
+    crate::manifest::Manifest::parse(&bad_version).unwrap_err();
+    // absurd entry count
+    let mut bad_count = bytes.clone();
+    bad_count[16..24].copy_from_slice(&u64::max_value().to_le_bytes());
+    crate::manifest::Manifest::parse(&bad_count).unwrap_err();
+
+    // A name offset pointing outside the names region parses, but the entry
+    // itself is rejected.
+    let mut bad_offset = bytes.clone();
+    let offset_position = crate::manifest::HEADER_LEN + blake3::OUT_LEN;
+    bad_offset[offset_position] = 1;
+    let manifest = crate::manifest::Manifest::parse(&bad_offset).unwrap();
+    manifest.entry(0).unwrap_err();
+    manifest.lookup("foo").unwrap_err();
+}
+
+#[test]
+#[cfg(unix)]
+fn test_direct_io() {
+    use crate::direct_io::{DirectFile, WINDOW_LEN};
+    let dir = tempfile::tempdir().unwrap();
+    let lengths = [
+        0,
+        1,
+        4095,
+        4096,
+        4097,
+        WINDOW_LEN - 1,
+        WINDOW_LEN,
+        3 * WINDOW_LEN + 12345,
+    ];
+    for &len in &lengths {
+        let input: Vec<u8> = (0..len).map(|i| (i % 251) as u8).collect();
+        let path = dir.path().join(len.to_string());
+        std::fs::write(&path, &input).unwrap();
+        let expected = blake3::hash(&input);
+        // Exercise the direct path (if this filesystem supports it), the
+        // drop-behind fallback, and cached reads, each with and without reader
+        // threads, and with and without a separate hashing pool.
+        let pool = rayon::ThreadPoolBuilder::new().build().unwrap();
+        for &queue_depth in &[1, 2, 8] {
+            for &open in &[
+                DirectFile::open,
+                DirectFile::open_drop_behind,
+                DirectFile::open_cached,
+            ] {
+                for &pool in &[None, Some(&pool)] {
+                    let file = open(&path).unwrap().unwrap();
+                    let mut hasher = blake3::Hasher::new();
+                    file.hash(&mut hasher, queue_depth, None, pool).unwrap();
+                    assert_eq!(expected, hasher.finalize(), "len {}", len);
+                }
+            }
+        }
+    }
+    // Directories aren't regular files.
+    assert!(DirectFile::open(dir.path()).unwrap().is_none());
+}
+
+#[test]
+#[cfg(unix)]
+fn test_read_window_short_reads() {
+    use crate::direct_io::{read_window, CacheMode};
+    use std::os::unix::fs::FileExt;
+
+    // Returns at most 1000 bytes per read, never aligned, like a FUSE or
+    // network filesystem might.
+    struct ShortReads(Vec<u8>);
+
+    impl FileExt for ShortReads {
+        fn read_at(&self, buf: &mut [u8], offset: u64) -> std::io::Result<usize> {
+            let start = std::cmp::min(offset as usize, self.0.len());
+            let n = std::cmp::min(std::cmp::min(buf.len(), 1000), self.0.len() - start);
+            buf[..n].copy_from_slice(&self.0[start..][..n]);
+            Ok(n)
+        }
+
+        fn write_at(&self, _buf: &[u8], _offset: u64) -> std::io::Result<usize> {
+            unreachable!()
+        }
+    }
+
+    let input: Vec<u8> = (0..10_000).map(|i| (i % 251) as u8).collect();
+    let file = ShortReads(input.clone());
+    let mut buf = vec![0; 8192];
+
+    // Buffered reads, including the cached ones that --device-queues does
+    // without --direct-io, keep going until the buffer is full or the input
+    // ends.
+    for &mode in &[CacheMode::DropBehind, CacheMode::Cached] {
+        let n = read_window(&file, &mut buf, 0, mode).unwrap();
+        assert_eq!(8192, n);
+        assert_eq!(&input[..8192], &buf[..]);
+        let n = read_window(&file, &mut buf, 8192, mode).unwrap();
+        assert_eq!(10_000 - 8192, n);
+        assert_eq!(&input[8192..], &buf[..n]);
+    }
+
+    // With O_DIRECT, an unaligned short read means EOF.
+    let n = read_window(&file, &mut buf, 0, CacheMode::Direct).unwrap();
+    assert_eq!(1000, n);
+}
+
+#[test]
+fn test_parse_rate() {
+    use crate::throttle::parse_rate;
+    assert_eq!(200.0, parse_rate("200").unwrap());
+    assert_eq!(200e6, parse_rate("200M").unwrap());
+    assert_eq!(200e6, parse_rate("200MB/s").unwrap());
+    assert_eq!(1.5e9, parse_rate("1.5G").unwrap());
+    assert_eq!(2048.0, parse_rate("2Ki").unwrap());
+    assert_eq!(3.0 * 1024.0 * 1024.0, parse_rate("3MiB").unwrap());
+    assert!(parse_rate("").is_err());
+    assert!(parse_rate("M").is_err());
+    assert!(parse_rate("10X").is_err());
+    assert!(parse_rate("0").is_err());
+    assert!(parse_rate("-5M").is_err());
+}
+
+#[test]
+fn test_throttle() {
+    use crate::throttle::{Throttle, SLICE_LEN};
+    use std::time::{Duration, Instant};
+    // The bucket starts full with one slice of tokens, so at 10 slices per
+    // second, three slices should take at least 0.2 seconds.
+    let throttle = Throttle::new(Some(10.0 * SLICE_LEN as f64), None);
+    let start = Instant::now();
+    for _ in 0..3 {
+        throttle.consume(SLICE_LEN as u64);
+    }
+    assert!(start.elapsed() >= Duration::from_millis(190));
+    assert!(throttle
+        .report()
+        .starts_with(&format!("hashed {} bytes", 3 * SLICE_LEN)));
+
+    // A core budget caps the thread count, but never below one.
+    let throttle = Throttle::new(None, Some(2.0));
+    assert_eq!(2, throttle.pool_size(8));
+    assert_eq!(1, throttle.pool_size(1));
+    let throttle = Throttle::new(None, Some(0.5));
+    assert_eq!(1, throttle.pool_size(8));
+    // No machine hashes slowly enough to need more than one thread for 1 KB/s.
+    let throttle = Throttle::new(Some(1000.0), None);
+    assert_eq!(1, throttle.pool_size(8));
+}
+
+#[test]
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn test_major_minor() {
+    use crate::device_queues::major_minor;
+    assert_eq!((8, 1), major_minor(0x801));
+    assert_eq!((254, 0), major_minor(0xfe00));
+    // Minor numbers above 255 and major numbers above 4095 are split across
+    // the high bits.
+    assert_eq!((8, 300), major_minor((8 << 8) | 44 | (256 << 12)));
+    assert_eq!((4096, 0), major_minor(4096 << 32));
+}
+
+#[test]
+fn test_path_reader() {
+    use crate::files_from::PathReader;
+    let read_all = |input: &[u8], separator| -> Vec<PathBuf> {
+        PathReader::new(input, separator)
+            .map(|path| path.unwrap())
+            .collect()
+    };
+    let expected: Vec<PathBuf> = vec!["a".into(), "b c".into(), "d".into()];
+    assert_eq!(expected, read_all(b"a\nb c\nd\n", b'\n'));
+    // The last separator is optional, and empty entries are skipped.
+    assert_eq!(expected, read_all(b"\na\n\nb c\nd", b'\n'));
+    assert_eq!(expected, read_all(b"a\0b c\0d\0", b'\0'));
+    assert_eq!(expected, read_all(b"a\0\0b c\0d", b'\0'));
+    // Newlines are part of the path in NUL-separated lists.
+    assert_eq!(vec![PathBuf::from("x\ny")], read_all(b"x\ny\0", b'\0'));
+    assert!(read_all(b"", b'\n').is_empty());
+}
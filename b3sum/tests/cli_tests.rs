@@ -548,3 +548,411 @@ fn test_globbing() {
         .unwrap();
     assert_eq!(expected, output);
 }
+
+#[test]
+fn test_manifest() {
+    let a_hash = blake3::hash(b"a");
+    let dir = tempfile::tempdir().unwrap();
+    fs::write(dir.path().join("a"), b"a").unwrap();
+    fs::write(dir.path().join("b"), b"b").unwrap();
+    fs::create_dir(dir.path().join("c")).unwrap();
+    fs::write(dir.path().join("c/d"), b"cd").unwrap();
+    let manifest_path = dir.path().join("manifest");
+
+    // Writing a manifest prints nothing.
+    let output = cmd!(
+        b3sum_exe(),
+        "--write-manifest",
+        &manifest_path,
+        "c/d",
+        "b",
+        "a"
+    )
+    .dir(dir.path())
+    .stdout_capture()
+    .stderr_capture()
+    .run()
+    .unwrap();
+    assert_eq!(b"", &output.stdout[..]);
+    assert_eq!(b"", &output.stderr[..]);
+    let manifest_bytes = fs::read(&manifest_path).unwrap();
+    assert_eq!(b"B3MANIF\0", &manifest_bytes[..8]);
+    // The first entry is "a", since entries are sorted.
+    assert_eq!(a_hash.as_bytes(), &manifest_bytes[32..64]);
+
+    // Check the whole manifest, in sorted order.
+    let output = cmd!(b3sum_exe(), "--check-manifest", &manifest_path)
+        .dir(dir.path())
+        .stdout_capture()
+        .stderr_capture()
+        .run()
+        .unwrap();
+    let stdout = std::str::from_utf8(&output.stdout).unwrap();
+    let stderr = std::str::from_utf8(&output.stderr).unwrap();
+    assert_eq!("a: OK\nb: OK\nc/d: OK\n", stdout);
+    assert_eq!("", stderr);
+
+    // The same manifest works from stdin.
+    let output = cmd!(b3sum_exe(), "--check-manifest")
+        .stdin_bytes(manifest_bytes.clone())
+        .dir(dir.path())
+        .read()
+        .unwrap();
+    assert_eq!("a: OK\nb: OK\nc/d: OK", output);
+
+    // Corrupt one of the files and check again, with --quiet.
+    fs::write(dir.path().join("b"), b"CORRUPTION").unwrap();
+    let output = cmd!(b3sum_exe(), "--check-manifest", "--quiet", &manifest_path)
+        .dir(dir.path())
+        .stdout_capture()
+        .stderr_capture()
+        .unchecked()
+        .run()
+        .unwrap();
+    let stdout = std::str::from_utf8(&output.stdout).unwrap();
+    let stderr = std::str::from_utf8(&output.stderr).unwrap();
+    assert!(!output.status.success());
+    assert_eq!("b: FAILED\n", stdout);
+    assert_eq!("", stderr);
+
+    // Look up individual paths. Only those paths are checked, in the order
+    // given, and a path that isn't in the manifest is an error.
+    let output = cmd!(
+        b3sum_exe(),
+        "--check-manifest",
+        &manifest_path,
+        "--lookup",
+        "c/d",
+        "--lookup",
+        "a",
+    )
+    .dir(dir.path())
+    .read()
+    .unwrap();
+    assert_eq!("c/d: OK\na: OK", output);
+    let output = cmd!(
+        b3sum_exe(),
+        "--check-manifest",
+        &manifest_path,
+        "--lookup",
+        "b",
+        "--lookup",
+        "missing",
+    )
+    .dir(dir.path())
+    .stdout_capture()
+    .stderr_capture()
+    .unchecked()
+    .run()
+    .unwrap();
+    let stdout = std::str::from_utf8(&output.stdout).unwrap();
+    let stderr = std::str::from_utf8(&output.stderr).unwrap();
+    assert!(!output.status.success());
+    assert_eq!("b: FAILED\n", stdout);
+    assert_eq!("b3sum: missing: Not found in manifest\n", stderr);
+
+    // Manifests can only be written in the default mode, since checking them
+    // always uses the default mode too.
+    let output = cmd!(
+        b3sum_exe(),
+        "--write-manifest",
+        &manifest_path,
+        "--derive-key",
+        "context",
+        "a"
+    )
+    .dir(dir.path())
+    .stdout_capture()
+    .stderr_capture()
+    .unchecked()
+    .run()
+    .unwrap();
+    assert!(!output.status.success());
+    let output = cmd!(
+        b3sum_exe(),
+        "--write-manifest",
+        &manifest_path,
+        "--keyed",
+        "a"
+    )
+    .stdin_bytes(&[0; 32][..])
+    .dir(dir.path())
+    .stdout_capture()
+    .stderr_capture()
+    .unchecked()
+    .run()
+    .unwrap();
+    assert!(!output.status.success());
+
+    // A text checkfile is not a manifest.
+    let output = cmd!(b3sum_exe(), "--check-manifest")
+        .stdin_bytes(format!("{}  a\n", a_hash.to_hex()))
+        .stdout_capture()
+        .stderr_capture()
+        .unchecked()
+        .run()
+        .unwrap();
+    assert!(!output.status.success());
+}
+
+#[test]
+#[cfg(unix)]
+fn test_direct_io() {
+    let dir = tempfile::tempdir().unwrap();
+    let small = b"foo".to_vec();
+    let large: Vec<u8> = (0..5_000_000).map(|i| (i % 251) as u8).collect();
+    fs::write(dir.path().join("small"), &small).unwrap();
+    fs::write(dir.path().join("large"), &large).unwrap();
+    let expected = format!(
+        "{}  small\n{}  large",
+        blake3::hash(&small).to_hex(),
+        blake3::hash(&large).to_hex(),
+    );
+    let output = cmd!(b3sum_exe(), "--direct-io", "small", "large")
+        .dir(dir.path())
+        .read()
+        .unwrap();
+    assert_eq!(expected, output);
+    let output = cmd!(
+        b3sum_exe(),
+        "--direct-io",
+        "--queue-depth",
+        "2",
+        "small",
+        "large"
+    )
+    .dir(dir.path())
+    .read()
+    .unwrap();
+    assert_eq!(expected, output);
+
+    // stdin still works, and so does checking.
+    let output = cmd!(b3sum_exe(), "--direct-io")
+        .stdin_bytes(&small[..])
+        .read()
+        .unwrap();
+    assert_eq!(format!("{}  -", blake3::hash(&small).to_hex()), output);
+    let output = cmd!(b3sum_exe(), "--direct-io", "--check")
+        .stdin_bytes(expected.as_bytes())
+        .dir(dir.path())
+        .read()
+        .unwrap();
+    assert_eq!("small: OK\nlarge: OK", output);
+
+    // Bad queue depths are rejected up front, even when only stdin is read.
+    for depth in &["0", "many"] {
+        for inputs in &[&["small", "large"][..], &[][..]] {
+            let output = cmd(
+                b3sum_exe(),
+                ["--direct-io", "--queue-depth", depth]
+                    .iter()
+                    .chain(inputs.iter()),
+            )
+            .dir(dir.path())
+            .stdin_bytes(&small[..])
+            .stdout_capture()
+            .stderr_capture()
+            .unchecked()
+            .run()
+            .unwrap();
+            assert!(!output.status.success());
+            assert!(output.stdout.is_empty());
+        }
+    }
+}
+
+#[test]
+fn test_throttle() {
+    let dir = tempfile::tempdir().unwrap();
+    let input: Vec<u8> = (0..3_000_000).map(|i| (i % 251) as u8).collect();
+    fs::write(dir.path().join("file"), &input).unwrap();
+    let expected = format!("{}  file", blake3::hash(&input).to_hex());
+    // Throttling doesn't change the output, and it reports the achieved rate
+    // on stderr. Cover the mmap, buffered, and stdin paths.
+    for flags in &[
+        &["--max-rate", "1G"][..],
+        &["--max-cores", "1", "--no-mmap"],
+    ] {
+        let output = cmd(b3sum_exe(), flags.iter().chain(&["file"]))
+            .dir(dir.path())
+            .stderr_capture()
+            .stdout_capture()
+            .run()
+            .unwrap();
+        assert_eq!(
+            expected,
+            std::str::from_utf8(&output.stdout).unwrap().trim()
+        );
+        let stderr = std::str::from_utf8(&output.stderr).unwrap();
+        assert!(
+            stderr.starts_with("b3sum: hashed 3000000 bytes in "),
+            "{}",
+            stderr
+        );
+        assert!(stderr.contains("MB/s"), "{}", stderr);
+    }
+    let output = cmd!(b3sum_exe(), "--max-rate", "100Mi", "--max-cores", "2")
+        .stdin_bytes(&input[..])
+        .stderr_null()
+        .read()
+        .unwrap();
+    assert_eq!(format!("{}  -", blake3::hash(&input).to_hex()), output);
+
+    // Bad budgets are errors.
+    for flags in &[["--max-rate", "fast"], ["--max-cores", "0"]] {
+        let output = cmd(b3sum_exe(), flags.iter().chain(&["file"]))
+            .dir(dir.path())
+            .stderr_capture()
+            .unchecked()
+            .run()
+            .unwrap();
+        assert!(!output.status.success());
+    }
+}
+
+#[test]
+#[cfg(unix)]
+fn test_device_queues() {
+    let dir = tempfile::tempdir().unwrap();
+    let names = ["a", "b", "c", "d", "e"];
+    let mut expected = Vec::new();
+    for (i, name) in names.iter().enumerate() {
+        let input: Vec<u8> = (0..i * 1_500_000).map(|j| (j % 251) as u8).collect();
+        fs::write(dir.path().join(name), &input).unwrap();
+        expected.push(format!("{}  {}", blake3::hash(&input).to_hex(), name));
+    }
+    // Output stays in command line order, whatever order the queues finish
+    // in, and with any depth.
+    for depth in &["1", "3"] {
+        let output = cmd(
+            b3sum_exe(),
+            ["--device-queues", "--queue-depth", depth]
+                .iter()
+                .chain(&names),
+        )
+        .dir(dir.path())
+        .read()
+        .unwrap();
+        assert_eq!(expected.join("\n"), output);
+    }
+    let output = cmd!(b3sum_exe(), "--device-queues", "--direct-io", "e", "a")
+        .dir(dir.path())
+        .read()
+        .unwrap();
+    assert_eq!(format!("{}\n{}", expected[4], expected[0]), output);
+
+    // Missing files are reported in order, and stdin still works.
+    let output = cmd!(b3sum_exe(), "--device-queues", "a", "missing", "-", "b")
+        .dir(dir.path())
+        .stdin_bytes("foo")
+        .stdout_capture()
+        .stderr_capture()
+        .unchecked()
+        .run()
+        .unwrap();
+    assert!(!output.status.success());
+    assert_eq!(
+        format!(
+            "{}\n{}  -\n{}\n",
+            expected[0],
+            blake3::hash(b"foo").to_hex(),
+            expected[1]
+        ),
+        std::str::from_utf8(&output.stdout).unwrap()
+    );
+    assert!(std::str::from_utf8(&output.stderr)
+        .unwrap()
+        .starts_with("b3sum: missing: "));
+
+    // Manifests can be written this way too.
+    let output = cmd(
+        b3sum_exe(),
+        ["--device-queues", "--write-manifest", "manifest"]
+            .iter()
+            .chain(&names),
+    )
+    .dir(dir.path())
+    .read()
+    .unwrap();
+    assert_eq!("", output);
+    let output = cmd!(b3sum_exe(), "--check-manifest", "manifest")
+        .dir(dir.path())
+        .read()
+        .unwrap();
+    assert_eq!("a: OK\nb: OK\nc: OK\nd: OK\ne: OK", output);
+
+    // Checking doesn't use device queues.
+    let output = cmd!(b3sum_exe(), "--device-queues", "--check", "manifest")
+        .dir(dir.path())
+        .stderr_capture()
+        .unchecked()
+        .run()
+        .unwrap();
+    assert!(!output.status.success());
+}
+
+#[test]
+fn test_files_from() {
+    let dir = tempfile::tempdir().unwrap();
+    let names = ["a", "b", "c d"];
+    let mut expected = Vec::new();
+    for (i, name) in names.iter().enumerate() {
+        let input: Vec<u8> = (0..i * 100_000).map(|j| (j % 251) as u8).collect();
+        fs::write(dir.path().join(name), &input).unwrap();
+        expected.push(format!("{}  {}", blake3::hash(&input).to_hex(), name));
+    }
+    let expected = expected.join("\n");
+    fs::write(dir.path().join("list"), "a\nb\nc d\n").unwrap();
+    fs::write(dir.path().join("list0"), "a\0b\0c d").unwrap();
+
+    let output = cmd!(b3sum_exe(), "--files-from", "list")
+        .dir(dir.path())
+        .read()
+        .unwrap();
+    assert_eq!(expected, output);
+    let output = cmd!(b3sum_exe(), "--files-from0", "list0", "--prefetch", "1")
+        .dir(dir.path())
+        .read()
+        .unwrap();
+    assert_eq!(expected, output);
+    let output = cmd!(b3sum_exe(), "--files-from", "-", "--no-mmap")
+        .stdin_bytes("a\nb\nc d\n")
+        .dir(dir.path())
+        .read()
+        .unwrap();
+    assert_eq!(expected, output);
+
+    // A missing file is reported, and the rest are still hashed.
+    let output = cmd!(b3sum_exe(), "--files-from", "-")
+        .stdin_bytes("a\nmissing\nb\n")
+        .dir(dir.path())
+        .stdout_capture()
+        .stderr_capture()
+        .unchecked()
+        .run()
+        .unwrap();
+    assert!(!output.status.success());
+    let stdout = std::str::from_utf8(&output.stdout).unwrap();
+    assert_eq!(2, stdout.lines().count());
+    assert!(std::str::from_utf8(&output.stderr)
+        .unwrap()
+        .starts_with("b3sum: missing: "));
+
+    // `-` in a list from stdin is an error, and so is a missing list or a
+    // list combined with file arguments.
+    for args in &[
+        &["--files-from", "-"][..],
+        &["--files-from", "nonexistent"],
+        &["--files-from", "list", "a"],
+    ] {
+        let output = cmd(b3sum_exe(), args.iter())
+            .stdin_bytes("-\n")
+            .dir(dir.path())
+            .stdout_capture()
+            .stderr_capture()
+            .unchecked()
+            .run()
+            .unwrap();
+        assert!(!output.status.success());
+    }
+}
@@ -17,22 +17,36 @@ INLINE void g(uint32_t *state, size_t a, size_t b, size_t c, size_t d,
   state[b] = rotr32(state[b] ^ state[c], 7);
 }
 
-INLINE void round_fn(uint32_t state[16], const uint32_t *msg, size_t round) {
-  // Select the message schedule based on the round.
-  const uint8_t *schedule = MSG_SCHEDULE[round];
+// The message permutation is resolved at compile time. Each round names its
+// message words as literal indices, rather than looking them up in
+// MSG_SCHEDULE, so the compression function is straight-line code even with
+// compilers and optimization levels that don't constant-fold that table.
+#define ROUND(state, m, s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11,      \
+              s12, s13, s14, s15)                                              \
+  do {                                                                         \
+    /* Mix the columns. */                                                     \
+    g(state, 0, 4, 8, 12, m[s0], m[s1]);                                       \
+    g(state, 1, 5, 9, 13, m[s2], m[s3]);                                       \
+    g(state, 2, 6, 10, 14, m[s4], m[s5]);                                      \
+    g(state, 3, 7, 11, 15, m[s6], m[s7]);                                      \
+    /* Mix the rows. */                                                        \
+    g(state, 0, 5, 10, 15, m[s8], m[s9]);                                      \
+    g(state, 1, 6, 11, 12, m[s10], m[s11]);                                    \
+    g(state, 2, 7, 8, 13, m[s12], m[s13]);                                     \
+    g(state, 3, 4, 9, 14, m[s14], m[s15]);                                     \
+  } while (0)
 
-  // Mix the columns.
-  g(state, 0, 4, 8, 12, msg[schedule[0]], msg[schedule[1]]);
-  g(state, 1, 5, 9, 13, msg[schedule[2]], msg[schedule[3]]);
-  g(state, 2, 6, 10, 14, msg[schedule[4]], msg[schedule[5]]);
-  g(state, 3, 7, 11, 15, msg[schedule[6]], msg[schedule[7]]);
-
-  // Mix the rows.
-  g(state, 0, 5, 10, 15, msg[schedule[8]], msg[schedule[9]]);
-  g(state, 1, 6, 11, 12, msg[schedule[10]], msg[schedule[11]]);
-  g(state, 2, 7, 8, 13, msg[schedule[12]], msg[schedule[13]]);
-  g(state, 3, 4, 9, 14, msg[schedule[14]], msg[schedule[15]]);
-}
+// These are the rows of MSG_SCHEDULE.
+#define ALL_ROUNDS(state, m)                                                   \
+  do {                                                                         \
+    ROUND(state, m, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);     \
+    ROUND(state, m, 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8);     \
+    ROUND(state, m, 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1);     \
+    ROUND(state, m, 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6);     \
+    ROUND(state, m, 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4);     \
+    ROUND(state, m, 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7);     \
+    ROUND(state, m, 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13);     \
+  } while (0)
 
 INLINE void compress_pre(uint32_t state[16], const uint32_t cv[8],
                          const uint8_t block[BLAKE3_BLOCK_LEN],
@@ -72,13 +86,7 @@ INLINE void compress_pre(uint32_t state[16], const uint32_t cv[8],
   state[14] = (uint32_t)block_len;
   state[15] = (uint32_t)flags;
 
-  round_fn(state, &block_words[0], 0);
-  round_fn(state, &block_words[0], 1);
-  round_fn(state, &block_words[0], 2);
-  round_fn(state, &block_words[0], 3);
-  round_fn(state, &block_words[0], 4);
-  round_fn(state, &block_words[0], 5);
-  round_fn(state, &block_words[0], 6);
+  ALL_ROUNDS(state, block_words);
 }
 
 void blake3_compress_in_place_portable(uint32_t cv[8],
@@ -33,11 +33,9 @@
 //! # Cargo Features
 //!
 //! The `std` feature (the only feature enabled by default) is required for
-//! implementations of the [`Write`] and [`Seek`] traits, and also for runtime
-//! CPU feature detection. If this feature is disabled, the only way to use the
-//! SIMD implementations in this crate is to enable the corresponding
-//! instruction sets globally, with e.g. `RUSTFLAGS="-C target-cpu=native"`. The
-//! resulting binary will not be portable to other machines.
+//! implementations of the [`Write`] and [`Seek`] traits. Runtime CPU feature
+//! detection on x86 works either way: without `std`, this crate queries CPUID
+//! itself rather than using `is_x86_feature_detected!`.
 //!
 //! The `rayon` feature (disabled by default, but enabled for [docs.rs]) adds
 //! the [`Hasher::update_rayon`] method, for multithreaded hashing. However,
@@ -86,8 +84,7 @@ pub mod platform;
 // Platform-specific implementations of the compression function. These
 // BLAKE3-specific cfg flags are set in build.rs.
 #[cfg(blake3_avx2_rust)]
-#[path = "rust_avx2.rs"]
-mod avx2;
+use rust_avx2 as avx2;
 #[cfg(blake3_avx2_ffi)]
 #[path = "ffi_avx2.rs"]
 mod avx2;
@@ -105,12 +102,21 @@ mod sse2;
 #[path = "ffi_sse2.rs"]
 mod sse2;
 #[cfg(blake3_sse41_rust)]
-#[path = "rust_sse41.rs"]
-mod sse41;
+use rust_sse41 as sse41;
 #[cfg(blake3_sse41_ffi)]
 #[path = "ffi_sse41.rs"]
 mod sse41;
 
+// The per-lane kernels behind keyed_hash_many() only exist as intrinsics, so
+// the SSE4.1 and AVX2 intrinsics modules are built on x86 even when the
+// assembly implementations above provide everything else.
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+#[cfg_attr(blake3_avx2_ffi, allow(dead_code))]
+mod rust_avx2;
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+#[cfg_attr(blake3_sse41_ffi, allow(dead_code))]
+mod rust_sse41;
+
 #[cfg(feature = "traits-preview")]
 pub mod traits;
 
@@ -120,7 +126,7 @@ use arrayref::{array_mut_ref, array_ref};
 use arrayvec::{ArrayString, ArrayVec};
 use core::cmp;
 use core::fmt;
-use platform::{Platform, MAX_SIMD_DEGREE, MAX_SIMD_DEGREE_OR_2};
+use platform::{Platform, MAX_LANES_DEGREE, MAX_SIMD_DEGREE, MAX_SIMD_DEGREE_OR_2};
 
 /// The number of bytes in a [`Hash`](struct.Hash.html), 32.
 pub const OUT_LEN: usize = 32;
@@ -833,6 +839,288 @@ pub fn keyed_hash(key: &[u8; KEY_LEN], input: &[u8]) -> Hash {
     hash_all_at_once::<join::SerialJoin>(input, &key_words, KEYED_HASH).root_hash()
 }
 
+/// The keyed hash function, applied to many inputs at once, each with its own
+/// key.
+///
+/// This sets `out[i]` to [`keyed_hash(&keys[i], inputs[i])`](fn.keyed_hash.html)
+/// for every `i`. Short inputs are packed into SIMD lanes, one input per lane,
+/// so that a batch of small MACs under different keys is computed in one
+/// vectorized pass. In comparison, calling [`keyed_hash`] in a loop does one
+/// compression at a time for any input shorter than four chunks (4 KiB).
+/// Inputs of 4 KiB or more are hashed one at a time as usual, because they
+/// have enough chunks to use SIMD on their own.
+///
+/// Lanes are available with SSE4.1 and AVX2 on x86 and x86-64. On other
+/// platforms this is equivalent to calling [`keyed_hash`] in a loop.
+///
+/// This function is always single-threaded.
+///
+/// # Panics
+///
+/// Panics if `keys`, `inputs`, and `out` aren't all the same length.
+pub fn keyed_hash_many(keys: &[[u8; KEY_LEN]], inputs: &[&[u8]], out: &mut [Hash]) {
+    assert_eq!(keys.len(), inputs.len(), "need one key per input");
+    assert_eq!(inputs.len(), out.len(), "need one output per input");
+    let platform = Platform::detect();
+    let degree = platform.lanes_degree();
+    if degree == 1 {
+        for i in 0..inputs.len() {
+            out[i] = keyed_hash(&keys[i], inputs[i]);
+        }
+        return;
+    }
+    let mut next_input = 0;
+    let mut lanes = ArrayVec::<Lane, MAX_LANES_DEGREE>::new();
+    while lanes.len() < degree {
+        match next_lane(keys, inputs, out, &mut next_input) {
+            Some(lane) => lanes.push(lane),
+            None => break,
+        }
+    }
+    let mut bufs = [[0; BLOCK_LEN]; MAX_LANES_DEGREE];
+    let mut cvs = [[0; 8]; MAX_LANES_DEGREE];
+    let mut block_lens = [0; MAX_LANES_DEGREE];
+    let mut counters = [0; MAX_LANES_DEGREE];
+    let mut flags = [0; MAX_LANES_DEGREE];
+    while !lanes.is_empty() {
+        let n = lanes.len();
+        let mut in_place = [None; MAX_LANES_DEGREE];
+        for j in 0..n {
+            let block = lanes[j].next_block(&mut bufs[j]);
+            cvs[j] = block.cv;
+            in_place[j] = block.in_place;
+            block_lens[j] = block.block_len;
+            counters[j] = block.counter;
+            flags[j] = block.flags;
+        }
+        let mut blocks = [&bufs[0]; MAX_LANES_DEGREE];
+        for j in 0..n {
+            blocks[j] = in_place[j].unwrap_or(&bufs[j]);
+        }
+        platform.compress_lanes(
+            &mut cvs[..n],
+            &blocks[..n],
+            &block_lens[..n],
+            &counters[..n],
+            &flags[..n],
+        );
+        // Going backwards, so that swap_remove() only moves lanes that are
+        // already finished with this step. Finished lanes are refilled right
+        // away, so that inputs of different lengths keep every lane busy.
+        for j in (0..n).rev() {
+            lanes[j].finish_block(&cvs[j]);
+            if lanes[j].step == LaneStep::Done {
+                out[lanes[j].index] = Hash(platform::le_bytes_from_words_32(&lanes[j].cv));
+                match next_lane(keys, inputs, out, &mut next_input) {
+                    Some(lane) => lanes[j] = lane,
+                    None => {
+                        lanes.swap_remove(j);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Return the next input for keyed_hash_many() that fits in a lane, hashing any
+// longer ones along the way.
+fn next_lane<'a>(
+    keys: &[[u8; KEY_LEN]],
+    inputs: &[&'a [u8]],
+    out: &mut [Hash],
+    next_input: &mut usize,
+) -> Option<Lane<'a>> {
+    while *next_input < inputs.len() {
+        let i = *next_input;
+        *next_input += 1;
+        if inputs[i].len() <= LANE_MAX_LEN {
+            return Some(Lane::new(i, &keys[i], inputs[i]));
+        }
+        out[i] = keyed_hash(&keys[i], inputs[i]);
+    }
+    None
+}
+
+// keyed_hash_many() packs inputs up to this long into lanes. With four full
+// chunks or more, keyed_hash() gets at least 4-way SIMD from hash_many(),
+// which keeps its state transposed from block to block and beats the lanes.
+// This also limits the CV stack of each lane to two entries.
+const LANE_MAX_LEN: usize = 4 * CHUNK_LEN - 1;
+const LANE_MAX_DEPTH: usize = 2;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum LaneStep {
+    // Compressing the next block of the current chunk.
+    Chunk,
+    // Merging the top two CVs on the stack, between chunks.
+    Merge,
+    // Merging the top of the stack with the CV of the last chunk, or of the
+    // subtree to its right. The final merge is the root.
+    Finish,
+    // `cv` is the root hash.
+    Done,
+}
+
+// The compression that a lane wants next. The block is either a full block of
+// input, used in place, or it's in the buffer passed to next_block().
+struct LaneBlock<'a> {
+    cv: CVWords,
+    in_place: Option<&'a [u8; BLOCK_LEN]>,
+    block_len: u8,
+    counter: u64,
+    flags: u8,
+}
+
+// One input in keyed_hash_many(), doing the same compressions as keyed_hash()
+// but one at a time, so that they can be interleaved with other inputs.
+struct Lane<'a> {
+    index: usize,
+    key: CVWords,
+    input: &'a [u8],
+    step: LaneStep,
+    // The CV of the chunk in progress, or of the subtree to the right of the
+    // stack while finishing.
+    cv: CVWords,
+    chunk_counter: u64,
+    // The position of the next block in `input`.
+    offset: usize,
+    cv_stack: ArrayVec<CVWords, LANE_MAX_DEPTH>,
+}
+
+impl<'a> Lane<'a> {
+    fn new(index: usize, key: &[u8; KEY_LEN], input: &'a [u8]) -> Self {
+        debug_assert!(input.len() <= LANE_MAX_LEN);
+        let key = platform::words_from_le_bytes_32(key);
+        Self {
+            index,
+            key,
+            input,
+            step: LaneStep::Chunk,
+            cv: key,
+            chunk_counter: 0,
+            offset: 0,
+            cv_stack: ArrayVec::new(),
+        }
+    }
+
+    fn chunk_end(&self) -> usize {
+        cmp::min(
+            (self.chunk_counter as usize + 1) * CHUNK_LEN,
+            self.input.len(),
+        )
+    }
+
+    fn parent_block(
+        &self,
+        left_child: &CVWords,
+        right_child: &CVWords,
+        buf: &mut [u8; BLOCK_LEN],
+        flags: u8,
+    ) -> LaneBlock<'a> {
+        buf[..OUT_LEN].copy_from_slice(&platform::le_bytes_from_words_32(left_child));
+        buf[OUT_LEN..].copy_from_slice(&platform::le_bytes_from_words_32(right_child));
+        LaneBlock {
+            cv: self.key,
+            in_place: None,
+            block_len: BLOCK_LEN as u8,
+            counter: 0,
+            flags: KEYED_HASH | PARENT | flags,
+        }
+    }
+
+    fn next_block(&self, buf: &mut [u8; BLOCK_LEN]) -> LaneBlock<'a> {
+        match self.step {
+            LaneStep::Chunk => {
+                let chunk_start = self.chunk_counter as usize * CHUNK_LEN;
+                let chunk_end = self.chunk_end();
+                let block_len = cmp::min(BLOCK_LEN, chunk_end - self.offset);
+                let mut flags = KEYED_HASH;
+                if self.offset == chunk_start {
+                    flags |= CHUNK_START;
+                }
+                if self.offset + block_len == chunk_end {
+                    flags |= CHUNK_END;
+                    if self.input.len() <= CHUNK_LEN {
+                        flags |= ROOT;
+                    }
+                }
+                let in_place = if block_len == BLOCK_LEN {
+                    Some(array_ref!(self.input, self.offset, BLOCK_LEN))
+                } else {
+                    *buf = [0; BLOCK_LEN];
+                    buf[..block_len].copy_from_slice(&self.input[self.offset..][..block_len]);
+                    None
+                };
+                LaneBlock {
+                    cv: self.cv,
+                    in_place,
+                    block_len: block_len as u8,
+                    counter: self.chunk_counter,
+                    flags,
+                }
+            }
+            LaneStep::Merge => {
+                let len = self.cv_stack.len();
+                self.parent_block(&self.cv_stack[len - 2], &self.cv_stack[len - 1], buf, 0)
+            }
+            LaneStep::Finish => {
+                let len = self.cv_stack.len();
+                let flags = if len == 1 { ROOT } else { 0 };
+                self.parent_block(&self.cv_stack[len - 1], &self.cv, buf, flags)
+            }
+            LaneStep::Done => unreachable!(),
+        }
+    }
+
+    // Before starting the next chunk, merge the stack down to one CV per
+    // complete subtree to its left, as Hasher::merge_cv_stack does. More input
+    // follows, so none of these merges is the root.
+    fn start_chunk(&mut self) {
+        if self.cv_stack.len() > self.chunk_counter.count_ones() as usize {
+            self.step = LaneStep::Merge;
+        } else {
+            self.cv = self.key;
+            self.step = LaneStep::Chunk;
+        }
+    }
+
+    fn finish_block(&mut self, new_cv: &CVWords) {
+        match self.step {
+            LaneStep::Chunk => {
+                self.cv = *new_cv;
+                let chunk_end = self.chunk_end();
+                self.offset += cmp::min(BLOCK_LEN, chunk_end - self.offset);
+                if self.offset < chunk_end {
+                    return;
+                }
+                if self.input.len() <= CHUNK_LEN {
+                    self.step = LaneStep::Done;
+                } else if self.offset == self.input.len() {
+                    self.step = LaneStep::Finish;
+                } else {
+                    self.cv_stack.push(self.cv);
+                    self.chunk_counter += 1;
+                    self.start_chunk();
+                }
+            }
+            LaneStep::Merge => {
+                self.cv_stack.pop();
+                self.cv_stack.pop();
+                self.cv_stack.push(*new_cv);
+                self.start_chunk();
+            }
+            LaneStep::Finish => {
+                self.cv_stack.pop();
+                self.cv = *new_cv;
+                if self.cv_stack.is_empty() {
+                    self.step = LaneStep::Done;
+                }
+            }
+            LaneStep::Done => unreachable!(),
+        }
+    }
+}
+
 /// The key derivation function.
 ///
 /// Given cryptographic key material of any length and a context string of any
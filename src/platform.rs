@@ -37,6 +37,16 @@ cfg_if::cfg_if! {
     }
 }
 
+// The widest compress_lanes() implementation. There's no AVX-512 or NEON
+// version, and on other platforms inputs aren't packed into lanes at all.
+cfg_if::cfg_if! {
+    if #[cfg(any(target_arch = "x86", target_arch = "x86_64"))] {
+        pub const MAX_LANES_DEGREE: usize = 8;
+    } else {
+        pub const MAX_LANES_DEGREE: usize = 1;
+    }
+}
+
 #[derive(Clone, Copy, Debug)]
 pub enum Platform {
     Portable,
@@ -272,6 +282,58 @@ impl Platform {
         }
     }
 
+    // The number of lanes that compress_lanes() does in one pass. A degree of
+    // 1 means there's no SIMD implementation, and callers are better off
+    // hashing their inputs one at a time.
+    pub fn lanes_degree(&self) -> usize {
+        let degree = match self {
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Platform::SSE41 => crate::rust_sse41::DEGREE,
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Platform::AVX2 => crate::rust_avx2::DEGREE,
+            #[cfg(blake3_avx512_ffi)]
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Platform::AVX512 if avx2_detected() => crate::rust_avx2::DEGREE,
+            _ => 1,
+        };
+        debug_assert!(degree <= MAX_LANES_DEGREE);
+        degree
+    }
+
+    // compress_lanes() compresses one block in each of several unrelated
+    // lanes, each with its own CV, block length, counter, and flags. That's
+    // what keyed_hash_many() needs to MAC many short inputs under different
+    // keys in one SIMD pass, where hash_many() would require a shared key.
+    pub fn compress_lanes(
+        &self,
+        cvs: &mut [CVWords],
+        blocks: &[&[u8; BLOCK_LEN]],
+        block_lens: &[u8],
+        counters: &[u64],
+        flags: &[u8],
+    ) {
+        match self {
+            // Safe because detect() checked for platform support.
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Platform::SSE41 => unsafe {
+                crate::rust_sse41::compress_lanes(cvs, blocks, block_lens, counters, flags)
+            },
+            // Safe because detect() checked for platform support.
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Platform::AVX2 => unsafe {
+                crate::rust_avx2::compress_lanes(cvs, blocks, block_lens, counters, flags)
+            },
+            // There's no AVX-512 version, so use AVX2 where it's enabled.
+            // Safe because avx2_detected() checked for platform support.
+            #[cfg(blake3_avx512_ffi)]
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Platform::AVX512 if avx2_detected() => unsafe {
+                crate::rust_avx2::compress_lanes(cvs, blocks, block_lens, counters, flags)
+            },
+            _ => portable::compress_lanes(cvs, blocks, block_lens, counters, flags),
+        }
+    }
+
     // Explicit platform constructors, for benchmarks.
 
     pub fn portable() -> Self {
@@ -322,6 +384,99 @@ impl Platform {
     }
 }
 
+// Without std, is_x86_feature_detected!() isn't available, so we query CPUID
+// ourselves, the same way the C implementation does in blake3_dispatch.c. The
+// result is cached in an atomic, so this only happens once.
+#[cfg(not(feature = "std"))]
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+pub(crate) mod cpuid {
+    #[cfg(target_arch = "x86")]
+    use core::arch::x86::{__cpuid, __cpuid_count, _xgetbv};
+    #[cfg(target_arch = "x86_64")]
+    use core::arch::x86_64::{__cpuid, __cpuid_count, _xgetbv};
+    use core::sync::atomic::{AtomicU32, Ordering};
+
+    pub const SSE2: u32 = 1 << 0;
+    pub const SSE41: u32 = 1 << 1;
+    pub const AVX2: u32 = 1 << 2;
+    // Only the C AVX-512 implementation needs these.
+    #[cfg(blake3_avx512_ffi)]
+    pub const AVX512F: u32 = 1 << 3;
+    #[cfg(blake3_avx512_ffi)]
+    pub const AVX512VL: u32 = 1 << 4;
+    // Set once detection has run, so that a CPU with none of the features
+    // above doesn't look undetected.
+    const DETECTED: u32 = 1 << 31;
+
+    static FEATURES: AtomicU32 = AtomicU32::new(0);
+
+    // CPUID isn't available in SGX enclaves, and it's missing on some very old
+    // 32-bit CPUs.
+    #[cfg(target_env = "sgx")]
+    fn query() -> u32 {
+        0
+    }
+
+    #[cfg(not(target_env = "sgx"))]
+    fn query() -> u32 {
+        #[cfg(target_arch = "x86")]
+        {
+            if !core::arch::x86::has_cpuid() {
+                return 0;
+            }
+        }
+        let mut features = 0;
+        // Safe because we've checked that CPUID is available, and XGETBV is
+        // only executed if CPUID reports that the OS has enabled it.
+        unsafe {
+            let max_leaf = __cpuid(0).eax;
+            let leaf1 = __cpuid(1);
+            if leaf1.edx & (1 << 26) != 0 {
+                features |= SSE2;
+            }
+            if leaf1.ecx & (1 << 19) != 0 {
+                features |= SSE41;
+            }
+            // AVX and AVX-512 also need the OS to save the wider registers on
+            // context switches, which we learn from XCR0 via OSXSAVE.
+            if leaf1.ecx & (1 << 27) != 0 && max_leaf >= 7 {
+                let xcr0 = _xgetbv(0);
+                let leaf7 = __cpuid_count(7, 0);
+                // SSE and AVX state.
+                if xcr0 & 6 == 6 {
+                    if leaf7.ebx & (1 << 5) != 0 {
+                        features |= AVX2;
+                    }
+                    // Opmask, ZMM_Hi256, and Hi16_ZMM state.
+                    #[cfg(blake3_avx512_ffi)]
+                    if xcr0 & 0xe0 == 0xe0 {
+                        if leaf7.ebx & (1 << 16) != 0 {
+                            features |= AVX512F;
+                        }
+                        if leaf7.ebx & (1 << 31) != 0 {
+                            features |= AVX512VL;
+                        }
+                    }
+                }
+            }
+        }
+        features
+    }
+
+    /// Whether the CPU supports all of the given features.
+    #[inline(always)]
+    pub fn detected(mask: u32) -> bool {
+        let mut features = FEATURES.load(Ordering::Relaxed);
+        if features == 0 {
+            // Racing threads compute the same value, so it doesn't matter who
+            // stores it.
+            features = query() | DETECTED;
+            FEATURES.store(features, Ordering::Relaxed);
+        }
+        features & mask == mask
+    }
+}
+
 // Note that AVX-512 is divided into multiple featuresets, and we use two of
 // them, F and VL.
 #[cfg(blake3_avx512_ffi)]
@@ -344,6 +499,13 @@ pub fn avx512_detected() -> bool {
             return true;
         }
     }
+    // Dynamic check without std.
+    #[cfg(not(feature = "std"))]
+    {
+        if cpuid::detected(cpuid::AVX512F | cpuid::AVX512VL) {
+            return true;
+        }
+    }
     false
 }
 
@@ -366,6 +528,13 @@ pub fn avx2_detected() -> bool {
             return true;
         }
     }
+    // Dynamic check without std.
+    #[cfg(not(feature = "std"))]
+    {
+        if cpuid::detected(cpuid::AVX2) {
+            return true;
+        }
+    }
     false
 }
 
@@ -388,6 +557,13 @@ pub fn sse41_detected() -> bool {
             return true;
         }
     }
+    // Dynamic check without std.
+    #[cfg(not(feature = "std"))]
+    {
+        if cpuid::detected(cpuid::SSE41) {
+            return true;
+        }
+    }
     false
 }
 
@@ -411,6 +587,13 @@ pub fn sse2_detected() -> bool {
             return true;
         }
     }
+    // Dynamic check without std.
+    #[cfg(not(feature = "std"))]
+    {
+        if cpuid::detected(cpuid::SSE2) {
+            return true;
+        }
+    }
     false
 }
 
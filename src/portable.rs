@@ -177,6 +177,27 @@ pub fn hash_many<const N: usize>(
     }
 }
 
+/// Compress one block in each of several independent lanes. Unlike
+/// hash_many, each lane has its own chaining value, block length, counter, and
+/// flags, so the lanes can come from unrelated inputs under different keys, at
+/// different points in their trees. The SIMD implementations transpose the
+/// lanes and do them all at once.
+pub fn compress_lanes(
+    cvs: &mut [CVWords],
+    blocks: &[&[u8; BLOCK_LEN]],
+    block_lens: &[u8],
+    counters: &[u64],
+    flags: &[u8],
+) {
+    debug_assert_eq!(cvs.len(), blocks.len());
+    debug_assert_eq!(cvs.len(), block_lens.len());
+    debug_assert_eq!(cvs.len(), counters.len());
+    debug_assert_eq!(cvs.len(), flags.len());
+    for i in 0..cvs.len() {
+        compress_in_place(&mut cvs[i], blocks[i], block_lens[i], counters[i], flags[i]);
+    }
+}
+
 #[cfg(test)]
 pub mod test {
     use super::*;
@@ -195,4 +216,10 @@ pub mod test {
     fn test_hash_many() {
         crate::test::test_hash_many_fn(hash_many, hash_many);
     }
+
+    // Ditto.
+    #[test]
+    fn test_compress_lanes() {
+        crate::test::test_compress_lanes_fn(compress_lanes);
+    }
 }
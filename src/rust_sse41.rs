@@ -492,8 +492,11 @@ unsafe fn transpose_vecs(vecs: &mut [__m128i; DEGREE]) {
     vecs[3] = abcd_3;
 }
 
+// Load one block from each input and transpose it into word-major vectors.
+// This never touches memory outside those blocks, so it's what the lane
+// kernels use, since they only get pointers to single 64-byte blocks.
 #[inline(always)]
-unsafe fn transpose_msg_vecs(inputs: &[*const u8; DEGREE], block_offset: usize) -> [__m128i; 16] {
+unsafe fn load_msg_vecs(inputs: &[*const u8; DEGREE], block_offset: usize) -> [__m128i; 16] {
     let mut vecs = [
         loadu(inputs[0].add(block_offset + 0 * 4 * DEGREE)),
         loadu(inputs[1].add(block_offset + 0 * 4 * DEGREE)),
@@ -512,9 +515,6 @@ unsafe fn transpose_msg_vecs(inputs: &[*const u8; DEGREE], block_offset: usize)
         loadu(inputs[2].add(block_offset + 3 * 4 * DEGREE)),
         loadu(inputs[3].add(block_offset + 3 * 4 * DEGREE)),
     ];
-    for i in 0..DEGREE {
-        _mm_prefetch(inputs[i].add(block_offset + 256) as *const i8, _MM_HINT_T0);
-    }
     let squares = mut_array_refs!(&mut vecs, DEGREE, DEGREE, DEGREE, DEGREE);
     transpose_vecs(squares.0);
     transpose_vecs(squares.1);
@@ -523,6 +523,21 @@ unsafe fn transpose_msg_vecs(inputs: &[*const u8; DEGREE], block_offset: usize)
     vecs
 }
 
+// Like load_msg_vecs, but also prefetch further into each input. Near the end
+// of a chunk the prefetch address runs past the input, which is harmless for
+// the prefetch itself, but the pointer arithmetic has to wrap to stay defined.
+#[inline(always)]
+unsafe fn transpose_msg_vecs(inputs: &[*const u8; DEGREE], block_offset: usize) -> [__m128i; 16] {
+    let vecs = load_msg_vecs(inputs, block_offset);
+    for i in 0..DEGREE {
+        _mm_prefetch(
+            inputs[i].wrapping_add(block_offset + 256) as *const i8,
+            _MM_HINT_T0,
+        );
+    }
+    vecs
+}
+
 #[inline(always)]
 unsafe fn load_counters(counter: u64, increment_counter: IncrementCounter) -> (__m128i, __m128i) {
     let mask = if increment_counter.yes() { !0 } else { 0 };
@@ -712,6 +727,153 @@ pub unsafe fn hash_many<const N: usize>(
     }
 }
 
+// Compress one block in each of DEGREE unrelated lanes. Unlike hash4, every
+// lane has its own chaining value, block length, counter, and flags.
+#[target_feature(enable = "sse4.1")]
+unsafe fn compress4_lanes(
+    cvs: &mut [CVWords; DEGREE],
+    blocks: &[*const u8; DEGREE],
+    block_lens: &[u8; DEGREE],
+    counters: &[u64; DEGREE],
+    flags: &[u8; DEGREE],
+) {
+    // Each lane's CV takes two vectors. Transposing the first halves and the
+    // second halves separately gives the word-major layout of the rounds.
+    let mut h_vecs = [
+        loadu(cvs[0].as_ptr().add(0) as *const u8),
+        loadu(cvs[1].as_ptr().add(0) as *const u8),
+        loadu(cvs[2].as_ptr().add(0) as *const u8),
+        loadu(cvs[3].as_ptr().add(0) as *const u8),
+        loadu(cvs[0].as_ptr().add(4) as *const u8),
+        loadu(cvs[1].as_ptr().add(4) as *const u8),
+        loadu(cvs[2].as_ptr().add(4) as *const u8),
+        loadu(cvs[3].as_ptr().add(4) as *const u8),
+    ];
+    let squares = mut_array_refs!(&mut h_vecs, DEGREE, DEGREE);
+    transpose_vecs(squares.0);
+    transpose_vecs(squares.1);
+    let msg_vecs = load_msg_vecs(blocks, 0);
+
+    let mut v = [
+        h_vecs[0],
+        h_vecs[1],
+        h_vecs[2],
+        h_vecs[3],
+        h_vecs[4],
+        h_vecs[5],
+        h_vecs[6],
+        h_vecs[7],
+        set1(IV[0]),
+        set1(IV[1]),
+        set1(IV[2]),
+        set1(IV[3]),
+        set4(
+            counter_low(counters[0]),
+            counter_low(counters[1]),
+            counter_low(counters[2]),
+            counter_low(counters[3]),
+        ),
+        set4(
+            counter_high(counters[0]),
+            counter_high(counters[1]),
+            counter_high(counters[2]),
+            counter_high(counters[3]),
+        ),
+        set4(
+            block_lens[0] as u32,
+            block_lens[1] as u32,
+            block_lens[2] as u32,
+            block_lens[3] as u32,
+        ),
+        set4(
+            flags[0] as u32,
+            flags[1] as u32,
+            flags[2] as u32,
+            flags[3] as u32,
+        ),
+    ];
+    round(&mut v, &msg_vecs, 0);
+    round(&mut v, &msg_vecs, 1);
+    round(&mut v, &msg_vecs, 2);
+    round(&mut v, &msg_vecs, 3);
+    round(&mut v, &msg_vecs, 4);
+    round(&mut v, &msg_vecs, 5);
+    round(&mut v, &msg_vecs, 6);
+    h_vecs[0] = xor(v[0], v[8]);
+    h_vecs[1] = xor(v[1], v[9]);
+    h_vecs[2] = xor(v[2], v[10]);
+    h_vecs[3] = xor(v[3], v[11]);
+    h_vecs[4] = xor(v[4], v[12]);
+    h_vecs[5] = xor(v[5], v[13]);
+    h_vecs[6] = xor(v[6], v[14]);
+    h_vecs[7] = xor(v[7], v[15]);
+
+    let squares = mut_array_refs!(&mut h_vecs, DEGREE, DEGREE);
+    transpose_vecs(squares.0);
+    transpose_vecs(squares.1);
+    storeu(h_vecs[0], cvs[0].as_mut_ptr().add(0) as *mut u8);
+    storeu(h_vecs[1], cvs[1].as_mut_ptr().add(0) as *mut u8);
+    storeu(h_vecs[2], cvs[2].as_mut_ptr().add(0) as *mut u8);
+    storeu(h_vecs[3], cvs[3].as_mut_ptr().add(0) as *mut u8);
+    storeu(h_vecs[4], cvs[0].as_mut_ptr().add(4) as *mut u8);
+    storeu(h_vecs[5], cvs[1].as_mut_ptr().add(4) as *mut u8);
+    storeu(h_vecs[6], cvs[2].as_mut_ptr().add(4) as *mut u8);
+    storeu(h_vecs[7], cvs[3].as_mut_ptr().add(4) as *mut u8);
+}
+
+#[target_feature(enable = "sse4.1")]
+pub unsafe fn compress_lanes(
+    cvs: &mut [CVWords],
+    blocks: &[&[u8; BLOCK_LEN]],
+    block_lens: &[u8],
+    counters: &[u64],
+    flags: &[u8],
+) {
+    debug_assert_eq!(cvs.len(), blocks.len());
+    debug_assert_eq!(cvs.len(), block_lens.len());
+    debug_assert_eq!(cvs.len(), counters.len());
+    debug_assert_eq!(cvs.len(), flags.len());
+    let mut start = 0;
+    while cvs.len() - start >= DEGREE {
+        // Safe because the layout of arrays is guaranteed.
+        let block_ptrs: &[*const u8; DEGREE] =
+            &*(blocks[start..].as_ptr() as *const [*const u8; DEGREE]);
+        compress4_lanes(
+            array_mut_ref!(cvs, start, DEGREE),
+            block_ptrs,
+            array_ref!(block_lens, start, DEGREE),
+            array_ref!(counters, start, DEGREE),
+            array_ref!(flags, start, DEGREE),
+        );
+        start += DEGREE;
+    }
+    if start < cvs.len() {
+        // As in the AVX2 implementation, a partial group is padded by
+        // repeating its first lane.
+        let n = cvs.len() - start;
+        let mut group_cvs = [cvs[start]; DEGREE];
+        let mut group_blocks = [blocks[start].as_ptr(); DEGREE];
+        let mut group_block_lens = [block_lens[start]; DEGREE];
+        let mut group_counters = [counters[start]; DEGREE];
+        let mut group_flags = [flags[start]; DEGREE];
+        for i in 1..n {
+            group_cvs[i] = cvs[start + i];
+            group_blocks[i] = blocks[start + i].as_ptr();
+            group_block_lens[i] = block_lens[start + i];
+            group_counters[i] = counters[start + i];
+            group_flags[i] = flags[start + i];
+        }
+        compress4_lanes(
+            &mut group_cvs,
+            &group_blocks,
+            &group_block_lens,
+            &group_counters,
+            &group_flags,
+        );
+        cvs[start..].copy_from_slice(&group_cvs[..n]);
+    }
+}
+
 #[cfg(test)]
 mod test {
     use super::*;
@@ -763,4 +925,12 @@ mod test {
         }
         crate::test::test_hash_many_fn(hash_many, hash_many);
     }
+
+    #[test]
+    fn test_compress_lanes() {
+        if !crate::platform::sse41_detected() {
+            return;
+        }
+        crate::test::test_compress_lanes_fn(compress_lanes);
+    }
 }
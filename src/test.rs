@@ -197,6 +197,57 @@ pub fn test_hash_many_fn(
     }
 }
 
+type CompressLanesFn = unsafe fn(
+    cvs: &mut [CVWords],
+    blocks: &[&[u8; BLOCK_LEN]],
+    block_lens: &[u8],
+    counters: &[u64],
+    flags: &[u8],
+);
+
+// A shared helper function for platform-specific tests.
+pub fn test_compress_lanes_fn(compress_lanes_fn: CompressLanesFn) {
+    // Up to 17 (8 + 8 + 1) lanes, to cover full groups and padded ones.
+    const MAX_LANES: usize = 17;
+    let mut input_buf = [0; MAX_LANES * BLOCK_LEN];
+    crate::test::paint_test_input(&mut input_buf);
+    for num_lanes in 0..=MAX_LANES {
+        let mut cvs = ArrayVec::<CVWords, MAX_LANES>::new();
+        let mut blocks = ArrayVec::<&[u8; BLOCK_LEN], MAX_LANES>::new();
+        let mut block_lens = ArrayVec::<u8, MAX_LANES>::new();
+        let mut counters = ArrayVec::<u64, MAX_LANES>::new();
+        let mut flags = ArrayVec::<u8, MAX_LANES>::new();
+        for i in 0..num_lanes {
+            // Give each lane a different key, block, length, counter, and
+            // flags. The counters have set bits in both 32-bit words.
+            let mut cv = TEST_KEY_WORDS;
+            cv[i % 8] ^= i as u32 + 1;
+            cvs.push(cv);
+            blocks.push(array_ref!(input_buf, i * BLOCK_LEN, BLOCK_LEN));
+            block_lens.push((BLOCK_LEN - i) as u8);
+            counters.push(((i as u64) << 32) + (u32::MAX - i as u32) as u64);
+            flags.push(crate::KEYED_HASH | (i % 16) as u8);
+        }
+
+        let mut portable_cvs = cvs.clone();
+        for i in 0..num_lanes {
+            crate::portable::compress_in_place(
+                &mut portable_cvs[i],
+                blocks[i],
+                block_lens[i],
+                counters[i],
+                flags[i],
+            );
+        }
+
+        let mut test_cvs = cvs.clone();
+        unsafe {
+            compress_lanes_fn(&mut test_cvs, &blocks, &block_lens, &counters, &flags);
+        }
+        assert_eq!(&portable_cvs[..], &test_cvs[..], "num_lanes {}", num_lanes);
+    }
+}
+
 #[test]
 fn test_key_bytes_equal_key_words() {
     assert_eq!(
@@ -372,6 +423,42 @@ fn reference_hash(input: &[u8]) -> crate::Hash {
     bytes.into()
 }
 
+#[test]
+fn test_keyed_hash_many() {
+    // Inputs of every length up to a few chunks, mixed together so that lanes
+    // finish at different times, plus some long enough to bypass the lanes.
+    const NUM_INPUTS: usize = 40;
+    let mut input_buf = [0; TEST_CASES_MAX];
+    paint_test_input(&mut input_buf);
+    let mut rng = rand_chacha::ChaCha8Rng::from_seed([2; 32]);
+    let mut keys = [TEST_KEY; NUM_INPUTS];
+    let mut inputs = ArrayVec::<&[u8], NUM_INPUTS>::new();
+    for (i, key) in keys.iter_mut().enumerate() {
+        key[i % crate::KEY_LEN] ^= i as u8 + 1;
+        let len = if i % 10 == 9 {
+            TEST_CASES[rng.gen_range(0..TEST_CASES.len())]
+        } else {
+            rng.gen_range(0..=crate::LANE_MAX_LEN + 1)
+        };
+        let start = rng.gen_range(0..=TEST_CASES_MAX - len);
+        inputs.push(&input_buf[start..][..len]);
+    }
+    for &len in TEST_CASES {
+        inputs[0] = &input_buf[..len];
+        for &num_inputs in &[0, 1, 3, 7, 8, 9, NUM_INPUTS] {
+            let mut out = [crate::Hash::from([0; 32]); NUM_INPUTS];
+            crate::keyed_hash_many(
+                &keys[..num_inputs],
+                &inputs[..num_inputs],
+                &mut out[..num_inputs],
+            );
+            for i in 0..num_inputs {
+                assert_eq!(crate::keyed_hash(&keys[i], inputs[i]), out[i]);
+            }
+        }
+    }
+}
+
 #[test]
 fn test_compare_update_multiple() {
     // Don't use all the long test cases here, since that's unnecessarily slow
@@ -564,3 +651,36 @@ fn test_hex_encoding_decoding() {
     #[cfg(feature = "std")]
     assert_eq!(_result.to_string(), "invalid hex character: 0x80");
 }
+
+#[test]
+#[cfg(not(feature = "std"))]
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+fn test_no_std_feature_detection() {
+    // The test harness links std even when the crate doesn't, so we can check
+    // our own CPUID queries against the standard library's.
+    extern crate std;
+    use crate::platform::cpuid;
+    assert_eq!(
+        std::is_x86_feature_detected!("sse2"),
+        cpuid::detected(cpuid::SSE2)
+    );
+    assert_eq!(
+        std::is_x86_feature_detected!("sse4.1"),
+        cpuid::detected(cpuid::SSE41)
+    );
+    assert_eq!(
+        std::is_x86_feature_detected!("avx2"),
+        cpuid::detected(cpuid::AVX2)
+    );
+    #[cfg(blake3_avx512_ffi)]
+    {
+        assert_eq!(
+            std::is_x86_feature_detected!("avx512f"),
+            cpuid::detected(cpuid::AVX512F)
+        );
+        assert_eq!(
+            std::is_x86_feature_detected!("avx512vl"),
+            cpuid::detected(cpuid::AVX512VL)
+        );
+    }
+}